@@ -0,0 +1,145 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "commons.h"
+#include "interval.h"
+
+// Axis-Aligned Bounding Box
+// A box whose faces are parallel to the x, y and z planes, described by one interval per axis.
+// Testing a ray against a box is much cheaper than testing it against the objects inside the box,
+// so if a ray misses the box we can skip everything inside it.
+class aabb
+{
+public:
+    interval x, y, z;
+
+    aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+    aabb(const interval &x, const interval &y, const interval &z) : x(x), y(y), z(z)
+    {
+        pad_to_minimums();
+    }
+
+    // Treat the two points a and b as extrema for the bounding box, so we don't require a
+    // particular minimum/maximum coordinate order.
+    aabb(const point3 &a, const point3 &b)
+    {
+        x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+        y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+        z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+
+        pad_to_minimums();
+    }
+
+    // Creates the box enclosing both input boxes
+    aabb(const aabb &box0, const aabb &box1)
+    {
+        x = interval(box0.x, box1.x);
+        y = interval(box0.y, box1.y);
+        z = interval(box0.z, box1.z);
+    }
+
+    const interval &axis_interval(int n) const
+    {
+        if (n == 1)
+            return y;
+        if (n == 2)
+            return z;
+        return x;
+    }
+
+    /*
+        Slab method:
+        Every axis contributes a "slab", the region between two parallel planes.
+        For the x axis, the ray P(t) = Q + t * d crosses the planes x = x0 and x = x1 at
+            t0 = (x0 - Qx) / dx
+            t1 = (x1 - Qx) / dx
+        The ray is inside the box only where it is inside all three slabs at the same time,
+        so we keep shrinking [ray_t.min, ray_t.max] with every slab and give up as soon as it becomes empty.
+    */
+    bool hit(const ray &r, interval ray_t) const
+    {
+        const point3 &ray_orig = r.origin();
+        const vec3 &ray_dir = r.direction();
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &ax = axis_interval(axis);
+            const double adinv = 1.0 / ray_dir[axis];
+
+            auto t0 = (ax.min - ray_orig[axis]) * adinv;
+            auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+            if (t0 < t1)
+            {
+                if (t0 > ray_t.min)
+                    ray_t.min = t0;
+                if (t1 < ray_t.max)
+                    ray_t.max = t1;
+            }
+            else
+            {
+                if (t1 > ray_t.min)
+                    ray_t.min = t1;
+                if (t0 < ray_t.max)
+                    ray_t.max = t0;
+            }
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    // Returns the index of the longest axis of the bounding box.
+    int longest_axis() const
+    {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        else
+            return y.size() > z.size() ? 1 : 2;
+    }
+
+    point3 centroid() const
+    {
+        return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    double surface_area() const
+    {
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
+    // Linearly interpolates between box a (at t = 0) and box b (at t = 1).
+    // If every object inside moves linearly, the interpolated box still encloses all of them at time t.
+    static aabb lerp(const aabb &a, const aabb &b, double t)
+    {
+        return aabb(interval((1 - t) * a.x.min + t * b.x.min, (1 - t) * a.x.max + t * b.x.max),
+                    interval((1 - t) * a.y.min + t * b.y.min, (1 - t) * a.y.max + t * b.y.max),
+                    interval((1 - t) * a.z.min + t * b.z.min, (1 - t) * a.z.max + t * b.z.max));
+    }
+
+    static const aabb empty, universe;
+
+private:
+    // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
+    // A flat box (e.g. around a quad lying in a plane) would otherwise have zero thickness
+    // and the slab test could miss it because of floating point precision.
+    void pad_to_minimums()
+    {
+        double delta = 0.0001;
+        if (x.size() < delta)
+            x = x.expand(delta);
+        if (y.size() < delta)
+            y = y.expand(delta);
+        if (z.size() < delta)
+            z = z.expand(delta);
+    }
+};
+
+const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
+const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+#endif
@@ -0,0 +1,99 @@
+#include "commons.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "plane.h"
+#include "sphere.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/*
+    Accumulation test
+    A render topped up from an accumulation file must be the same image as one render of all the samples:
+    the samplers give every pixel the same samples whatever renders them, and the earlier sums are added
+    first, so every float is summed in the same order. This test renders a small Cornell box out of core
+    (tile_output, the tiles read accumulation_input and write accumulation_output a tile at a time):
+        - all 8 samples per pixel in one render
+        - samples 0-3, then samples 4-7 topped up from the accumulation file of the first, in worker processes
+    and checks that the two PFM files and the two accumulation files (with depth, normal and material id
+    passes) are the same byte for byte. The files are written in the current directory.
+    Returns 0 if they are.
+*/
+
+std::string read_file(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+int main()
+{
+    hittable_list world;
+    hittable_list lights;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(370, 120, 370), 120, white));
+
+    auto ceiling_light = make_shared<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), light);
+    world.add(ceiling_light);
+    lights.add(ceiling_light);
+    world = hittable_list(make_shared<bvh_node>(world));
+
+    // Renders samples [first_sample, first_sample + samples) into "<name>.pfm" and "<name>.acc"
+    auto render = [&](const std::string &name, int first_sample, int samples, const std::string &earlier, int workers) {
+        camera_config config = {
+            1.0,                    // Aspect ratio
+            40,                     // Image width
+            samples,                // Samples per pixel
+            10,                     // Max depth
+            40,                     // Vertical field of view
+            point3(278, 278, -800), // Look from
+            point3(278, 278, 0),    // Look at
+            vec3(0, 1, 0),          // Vertical up vector from camera
+            0,                      // Defocus angle
+            10,                     // Focus distance
+            0,                      // Shutter open
+            0,                      // Shutter close
+            0                       // Packet size (0 = trace camera rays one at a time)
+        };
+        config.black_background = true;
+        config.sampling = sampling_pattern::sobol;
+        config.aovs = {pass::depth, pass::normal, pass::material_id};
+        config.tile_size = 16;
+        config.tile_output = "accumulation_test_" + name + ".pfm";
+        config.workers = workers;
+        config.first_sample = first_sample;
+        config.accumulation_input = earlier;
+        config.accumulation_output = "accumulation_test_" + name + ".acc";
+        camera cam(config);
+        cam.render(world, lights);
+    };
+    render("full", 0, 8, "", 0);
+    render("first", 0, 4, "", 0);
+    render("topped_up", 4, 4, "accumulation_test_first.acc", 2);
+
+    int failures = 0;
+    for (auto extension : {".pfm", ".acc"})
+    {
+        auto full = read_file(std::string("accumulation_test_full") + extension);
+        auto topped_up = read_file(std::string("accumulation_test_topped_up") + extension);
+        bool same = !full.empty() && full == topped_up;
+        std::printf("%s: %s\n", extension, same ? "ok" : "FAILED, the topped up render is not the full render");
+        failures += same ? 0 : 1;
+    }
+    return failures == 0 ? 0 : 1;
+}
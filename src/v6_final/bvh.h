@@ -0,0 +1,296 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "parallel.h"
+#include "traversal_stats.h"
+
+#include <algorithm>
+#include <thread>
+
+// Bounding Volume Hierarchy
+// A binary tree of bounding boxes. Every node stores the box enclosing its two children,
+// and the leaves are the actual objects of the scene.
+// hittable_list tests a ray against every object (O(n)), while the BVH discards a whole subtree
+// as soon as the ray misses its box, which brings the cost of a ray down to roughly O(log n).
+class bvh_node : public hittable
+{
+public:
+    // There's a C++ subtlety here. This constructor (without span indices) creates an
+    // implicit copy of the hittable list, which we will modify. The lifetime of the copied
+    // list only extends until this constructor exits. That's OK, because we only need to
+    // persist the resulting bounding volume hierarchy.
+    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
+
+    bvh_node(std::vector<shared_ptr<hittable>> &objects, size_t start, size_t end)
+    {
+        // Build the bounding box of the span of source objects.
+        bbox = aabb::empty;
+        for (size_t object_index = start; object_index < end; object_index++)
+            bbox = aabb(bbox, objects[object_index]->bounding_box());
+
+        // Split along the longest axis of the box, this keeps the children boxes as compact as possible.
+        int axis = bbox.longest_axis();
+
+        size_t object_span = end - start;
+
+        if (object_span == 1)
+        {
+            left = right = objects[start];
+        }
+        else if (object_span == 2)
+        {
+            left = objects[start];
+            right = objects[start + 1];
+        }
+        else
+        {
+            // Sort the objects by the position of their boxes along the split axis
+            // and put the first half in the left child and the second half in the right child.
+            std::sort(objects.begin() + start, objects.begin() + end,
+                      [axis](const shared_ptr<hittable> &a, const shared_ptr<hittable> &b)
+                      { return box_compare(a, b, axis); });
+
+            auto mid = start + object_span / 2;
+            left = make_shared<bvh_node>(objects, start, mid);
+            right = make_shared<bvh_node>(objects, mid, end);
+        }
+
+        update_motion_boxes();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        if (auto stats = traversal_stats::current())
+            stats->visit(this);
+
+        // The box over the whole time range can be much bigger than the objects inside at any
+        // given moment, so nodes with moving objects test the box at the ray's time instead.
+        if (moving)
+        {
+            if (!aabb::lerp(box_time0, box_time1, r.time()).hit(r, ray_t))
+                return false;
+        }
+        else if (!bbox.hit(r, ray_t))
+            return false;
+
+        // If the left child is hit, the right child only needs to be checked for a closer hit
+        bool hit_left = left->hit(r, ray_t, rec);
+        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+        return hit_left || hit_right;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        if (auto stats = traversal_stats::current())
+            stats->visit(this);
+
+        if (moving)
+        {
+            if (!aabb::lerp(box_time0, box_time1, r.time()).hit(r, ray_t))
+                return false;
+        }
+        else if (!bbox.hit(r, ray_t))
+            return false;
+
+        // The right subtree is skipped as soon as the left one blocks the ray
+        return left->occluded(r, ray_t) || (right != left && right->occluded(r, ray_t));
+    }
+
+    // The packet visits a node if at least one of its rays enters the node's box,
+    // and only the rays that entered the box are passed down to the children.
+    // Moving nodes use the box over the whole time range, every ray has its own time.
+    void hit_packet(const ray_packet &packet, const unsigned char *active, double t_min,
+                    packet_hits &hits) const override
+    {
+        if (packet.frustum_culls(bbox))
+            return;
+
+        unsigned char inside[ray_packet::max_size];
+        if (!packet.hit_box(bbox, active, t_min, hits.t, inside))
+            return;
+
+        left->hit_packet(packet, inside, t_min, hits);
+        if (right != left)
+            right->hit_packet(packet, inside, t_min, hits);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override
+    {
+        return moving ? aabb::lerp(box_time0, box_time1, time) : bbox;
+    }
+
+    // Refit: when objects move but the tree structure stays the same, only the boxes need updating.
+    // Every node's box is recomputed bottom-up from its children, which is O(n) instead of
+    // the O(n log n) sort of a full rebuild.
+    // The top levels of the tree hand their left subtree to a new thread, so with 2^depth threads
+    // the subtrees are refit in parallel. Subtrees are disjoint, so no locking is needed.
+    aabb refit() override
+    {
+        int depth = 0;
+        while ((1u << depth) < thread_count())
+            depth++;
+        return refit(depth);
+    }
+
+    aabb refit(int parallel_depth)
+    {
+        if (left == right)
+        {
+            bbox = refit_child(left, 0);
+        }
+        else if (parallel_depth > 0)
+        {
+            aabb left_box;
+            std::thread worker([&]() { left_box = refit_child(left, parallel_depth - 1); });
+            aabb right_box = refit_child(right, parallel_depth - 1);
+            worker.join();
+            bbox = aabb(left_box, right_box);
+        }
+        else
+        {
+            bbox = aabb(refit_child(left, 0), refit_child(right, 0));
+        }
+        update_motion_boxes();
+        return bbox;
+    }
+
+    /*
+        Surface Area Heuristic (SAH)
+        The probability that a random ray hitting the root box also hits a child box is
+        roughly the ratio of their surface areas. So the expected cost of a ray is:
+            cost = Σ (SA(node) / SA(root)) * traversal_cost       for every internal node
+                 + Σ (SA(leaf) / SA(root)) * intersection_cost    for every object
+        After refitting, boxes of a tree built for old positions start to overlap and grow,
+        and this cost goes up. It's used to decide when a refit isn't good enough anymore.
+    */
+    double sah_cost() const
+    {
+        double root_area = bbox.surface_area();
+        if (root_area <= 0)
+            return 0;
+        return sah_cost_sum() / root_area;
+    }
+
+private:
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    aabb bbox;       // Box over the whole time range [0, 1]
+    aabb box_time0;  // Box at time 0
+    aabb box_time1;  // Box at time 1
+    bool moving;     // True if anything inside the node moves
+
+    // Time-bounded boxes: the node stores the boxes of its children at time 0 and 1
+    void update_motion_boxes()
+    {
+        box_time0 = aabb(left->bounding_box_at(0), right->bounding_box_at(0));
+        box_time1 = aabb(left->bounding_box_at(1), right->bounding_box_at(1));
+        moving = !same_box(box_time0, box_time1);
+    }
+
+    static bool same_box(const aabb &a, const aabb &b)
+    {
+        return a.x.min == b.x.min && a.x.max == b.x.max
+            && a.y.min == b.y.min && a.y.max == b.y.max
+            && a.z.min == b.z.min && a.z.max == b.z.max;
+    }
+
+    static constexpr double traversal_cost = 1.0;
+    static constexpr double intersection_cost = 1.0;
+
+    static aabb refit_child(const shared_ptr<hittable> &child, int parallel_depth)
+    {
+        auto node = dynamic_cast<bvh_node *>(child.get());
+        if (node)
+            return node->refit(parallel_depth);
+        return child->refit();
+    }
+
+    double sah_cost_sum() const
+    {
+        double cost = traversal_cost * bbox.surface_area();
+        cost += child_cost(left);
+        if (right != left)
+            cost += child_cost(right);
+        return cost;
+    }
+
+    static double child_cost(const shared_ptr<hittable> &child)
+    {
+        auto node = dynamic_cast<const bvh_node *>(child.get());
+        if (node)
+            return node->sah_cost_sum();
+        return intersection_cost * child->bounding_box().surface_area();
+    }
+
+    static bool box_compare(const shared_ptr<hittable> &a, const shared_ptr<hittable> &b, int axis_index)
+    {
+        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
+        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
+        return a_axis_interval.min < b_axis_interval.min;
+    }
+};
+
+// A BVH for scenes whose objects move between frames (animation).
+// After moving the objects (e.g. with sphere::set_center), call update() once per frame:
+// it refits the existing tree, and only when the tree quality has degraded too much
+// (the SAH cost grew by more than rebuild_threshold compared to a fresh build)
+// it rebuilds the tree from scratch.
+class dynamic_bvh : public hittable
+{
+public:
+    dynamic_bvh(hittable_list list, double rebuild_threshold = 1.5)
+        : objects(list), rebuild_threshold(rebuild_threshold)
+    {
+        rebuild();
+    }
+
+    // Returns true if the tree was rebuilt, false if a refit was enough.
+    bool update()
+    {
+        root->refit();
+        if (root->sah_cost() > rebuild_threshold * build_cost)
+        {
+            rebuild();
+            return true;
+        }
+        return false;
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return root->hit(r, ray_t, rec);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return root->occluded(r, ray_t);
+    }
+
+    aabb bounding_box() const override { return root->bounding_box(); }
+
+    aabb refit() override
+    {
+        update();
+        return root->bounding_box();
+    }
+
+private:
+    hittable_list objects; // Kept so the tree can be rebuilt
+    shared_ptr<bvh_node> root;
+    double build_cost;     // SAH cost of the tree right after the last rebuild
+    double rebuild_threshold;
+
+    void rebuild()
+    {
+        root = make_shared<bvh_node>(objects);
+        build_cost = root->sah_cost();
+    }
+};
+
+#endif
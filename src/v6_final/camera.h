@@ -2,8 +2,31 @@
 #define CAMERA_H
 
 #include "commons.h"
+#include "denoise.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "image_io.h"
 #include "hittable.h"
 #include "material.h"
+#include "png.h"
+#include "ray_batch.h"
+#include "sampler.h"
+#include "tile_stream.h"
+#include "worker_pool.h"
+#include "traversal_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Rectangle of the image in pixels, x and y of its top left corner
+struct crop_window
+{
+    int x, y, width, height;
+};
 
 struct camera_config {
     double aspect_ratio;
@@ -16,6 +39,39 @@ struct camera_config {
     vec3 vup;
     double defocus_angle;
     double focus_dist;
+    double shutter_open;
+    double shutter_close;
+    int packet_size;
+    int batch_size;     // Number of camera samples traced together by the batched renderer (0 = off)
+    bool sort_rays;     // Batched renderer: reorder the rays before every bounce
+    bool black_background; // No sky, the scene is only lit by its lights
+    shared_ptr<environment_map> environment; // Light coming from all around the scene instead of the sky (optional)
+    sampling_pattern sampling; // How the random numbers of the samples of a pixel are spread (see sampler.h),
+                               // blue_noise looks best for quick previews with 1-4 samples per pixel
+    bool denoise;       // Filter the noise out of the finished image (see denoise.h), for 16-32 samples per pixel
+    std::vector<pass> aovs; // Extra passes to render along with the image (see framebuffer.h), each written
+                            // to "<aov_prefix><pass name>.pfm" if aov_prefix is set, and into hdr_output
+    std::string aov_prefix;
+    std::string hdr_output; // Also write the image in linear floats, with no clamping or gamma, to this file:
+                            // PFM, or OpenEXR with every pass as extra channels if it ends with ".exr"
+    std::string png_output; // Also write the image as a PNG file (the same pixels as the PPM, a fraction of the size)
+    int tile_size;          // Render square tiles of this size on all threads (0 = one scanline after the other),
+                            // tiles take the place of packets and batches
+    std::string tile_stream; // Send every tile to this file or pipe as soon as it is done (see tile_stream.h),
+                             // "-" sends them to std::cout instead of the PPM. Turns tiles on (32 pixels) if needed
+    std::string tile_output; // For images too large for memory: tiles are written straight into this PFM file,
+                             // which is the only output (turns tiles on like tile_stream)
+    crop_window crop;       // Render only this part of the image (0 x 0 = all of it). The camera still frames the
+                            // whole image, so the region looks exactly as in a full render with the same sampling
+    std::string crop_background; // A float image of a previous full render (hdr_output, tile_output...) to paste the
+                                 // region into, the output is then the whole image. Without it, the region alone
+    int workers;            // Render the tiles in this many worker processes instead of threads (see worker_pool.h),
+                            // turns tiles on like tile_stream
+    int first_sample;       // Render samples [first_sample, first_sample + samples_per_pixel) of every pixel, so
+                            // several renders can each take a range of the samples of the same image
+    std::string accumulation_input;  // Accumulation file (see image_io.h) of earlier samples of the image, the new
+                                     // samples are added to them: a render can be topped up with more samples
+    std::string accumulation_output; // Write the sums of the samples to this file, for topping up or merge.cpp
 };
 
 class camera
@@ -40,6 +96,35 @@ private:
     vec3   defocus_disk_v;                      // Defocus disk vertical radius
     double defocus_angle = 0;                   // Variation angle of rays through each pixel
     double focus_dist = 10;                     // Distance from camera lookfrom point to plane of perfect focus
+    double shutter_open = 0;                    // Time the shutter opens, in [0, 1]
+    double shutter_close = 0;                   // Time the shutter closes, in [0, 1]
+    int packet_size = 0;                        // Side of the square blocks of camera rays traced together (0 = off)
+    int batch_size = 0;                         // Camera samples traced together, one bounce at a time (0 = off)
+                                                // A few tens of thousands keeps the batch in the CPU caches
+    bool sort_rays = false;                     // Reorder the batch by ray direction and origin before each bounce
+    bool black_background = false;              // Rays that escape the scene bring back no light
+    shared_ptr<environment_map> environment;    // Replaces the sky, sampled directly like the lights
+    const hittable *lights = nullptr;           // Objects sampled directly by diffuse surfaces, set by render()
+    double light_fraction = 0;                  // Share of the light samples sent to "lights" rather than the environment
+    sampling_pattern sampling = sampling_pattern::independent; // Random numbers, or well spread sample patterns
+    bool denoise = false;                       // Run the denoiser on the image before writing it
+    std::vector<pass> aovs;                     // Passes written to files besides the image
+    std::string aov_prefix;                     // Start of the names of these files
+    std::string hdr_output;                     // Float image file, for tonemapping later (see tonemap.cpp)
+    std::string png_output;                     // PNG image file
+    int tile_size = 0;                          // Tile mode: size of the tiles rendered in parallel
+    std::string tile_stream;                    // Where finished tiles are sent, if anywhere
+    std::string tile_output;                    // PFM file the tiles are written to instead of keeping the image
+    crop_window crop = {0, 0, 0, 0};            // Part of the image to render
+    std::string crop_background;                // Image the region is pasted into
+    int workers = 0;                            // Worker processes rendering the tiles
+    int first_sample = 0;                       // Index of the first sample rendered in every pixel
+    std::string accumulation_input;             // Earlier samples to start from
+    std::string accumulation_output;            // Where the sums of the samples are saved
+    int region_x, region_y;                     // The pixels rendered: the crop window clamped to the image,
+    int region_width, region_height;            // or all of it. The framebuffer only holds these pixels
+
+    framebuffer frame;                          // The image and the other passes, filled while rendering
 
 
 
@@ -98,9 +183,37 @@ private:
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;        
+
+        // The pixels to render
+        region_x = 0;
+        region_y = 0;
+        region_width = image_width;
+        region_height = image_height;
+        if (crop.width > 0 && crop.height > 0)
+        {
+            region_x = std::min(std::max(crop.x, 0), image_width - 1);
+            region_y = std::min(std::max(crop.y, 0), image_height - 1);
+            region_width = std::min(crop.x + crop.width, image_width) - region_x;
+            region_height = std::min(crop.y + crop.height, image_height) - region_y;
+            if (region_width < 1 || region_height < 1)
+            {
+                std::clog << "The crop window is outside the image, rendering all of it\n";
+                region_x = region_y = 0;
+                region_width = image_width;
+                region_height = image_height;
+            }
+        }
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world) const
+    // Index in the framebuffer of the pixel with index "pixel" in the whole image
+    size_t frame_pixel(std::uint64_t pixel) const
+    {
+        return size_t(pixel / image_width - region_y) * region_width + pixel % image_width - region_x;
+    }
+
+    // scatter_pdf is the density with which the material the ray bounced off picked its direction,
+    // 0 for camera rays and mirror-like bounces (see hit_color)
+    color ray_color(const ray &r, int depth, const hittable &world, double scatter_pdf = 0) const
     {
         if (depth <= 0)
             return color(0,0,0);
@@ -108,18 +221,171 @@ private:
 
         // If ray hits sphere
         if (world.hit(r, interval(0.001, infinity), rec))
+            return hit_color(r, rec, depth, world, scatter_pdf);
+
+        return escaped_light(r, scatter_pdf);
+    }
+
+    // ray_color of a camera ray, which also fills the other passes of "target" with what the ray hits first
+    color camera_ray_color(const ray &r, framebuffer &target, size_t pixel, const hittable &world)
+    {
+        hit_record rec;
+        bool hit = max_depth > 0 && world.hit(r, interval(0.001, infinity), rec);
+        add_first_hit(target, pixel, r, hit ? &rec : nullptr);
+
+        if (max_depth <= 0)
+            return color(0,0,0);
+        return hit ? hit_color(r, rec, max_depth, world) : background_color(r);
+    }
+
+    // Adds (some of) the light of sample "sample" to its pixel. "target" is the framebuffer of the whole image,
+    // or of a single tile (pixel is then the index in the tile).
+    void add_sample(framebuffer &target, size_t pixel, int sample, const color &light)
+    {
+        target.add(pass::beauty, pixel, light);
+        // Odd counting from first_sample, so a render of any range of samples has half of them odd
+        if (((sample - first_sample) & 1) && target.has(pass::odd_samples))
+            target.add(pass::odd_samples, pixel, light);
+    }
+
+    // Counts a new sample of the pixel and adds the surface its camera ray "r" hit first to the passes
+    // (rec is nullptr if it hit nothing). Called exactly once for every sample.
+    void add_first_hit(framebuffer &target, size_t pixel, const ray &r, const hit_record *rec)
+    {
+        target.add(pass::sample_count, pixel, 1.0);
+        if (target.has(pass::depth) && rec)
+            target.keep_min(pass::depth, pixel, rec->t * r.direction().length());
+        if (target.has(pass::normal) && rec)
+            target.add(pass::normal, pixel, rec->normal);
+        if (target.has(pass::albedo))
+            target.add(pass::albedo, pixel, rec ? rec->mat->base_color(*rec) : color(1,1,1));
+        // The id of the very first sample of the pixel: with accumulation_input, the one of the earlier render
+        if (target.has(pass::material_id) && target.plane(pass::sample_count)[pixel] == 1)
+            target.set(pass::material_id, pixel, rec ? rec->mat->id() : 0);
+    }
+
+    /*
+        Color seen along ray "r" which hit a surface described by "rec"
+        With only scattered rays, a small light is found by pure chance and most paths bring back nothing.
+        Diffuse surfaces also send a shadow ray straight to a random point of a light (next event estimation,
+        see sample_lights), so every bounce collects the direct light unless something is in the way.
+        A light can now be reached in two ways: by the shadow ray, or by the scattered ray happening to hit it.
+        Counting both fully would add that light twice, so each is weighted by multiple importance sampling:
+        the weight of a strategy grows with how likely it was to find that direction. Shadow rays win for
+        small lights, scattered rays win for large lights seen from a shiny surface, and the weights of
+        both always add up to 1.
+    */
+    color hit_color(const ray &r, const hit_record &rec, int depth, const hittable &world, double scatter_pdf = 0) const
+    {
+        color emission = emitted_light(r, rec, scatter_pdf);
+
+        int bounce = max_depth - depth;
+        auto pattern = sampler::current();
+        if (pattern)
+            pattern->start_scatter(bounce);
+
+        ray scattered;
+        color attenuation;
+        // const ray& r_in         <- Incoming ray hitting the surface
+        // const hit_record& rec   <- Information about the hit point (position, normal, etc.)
+        // color& attenuation      <- How much light the material absorbs or reflects
+        // ray& scattered          <- The scattered (reflected/refracted) ray        
+        if (!rec.mat->scatter(r, rec, attenuation, scattered))
+            return emission;
+
+        auto pdf = rec.mat->scattering_pdf(r, rec, scattered);
+        color incoming = ray_color(scattered, depth-1, world, pdf);
+        // The shadow ray is one more bounce, the last bounce has no budget left for it
+        if (pdf > 0 && depth > 1)
         {
-            ray scattered;
-            color attenuation;
-            // const ray& r_in         <- Incoming ray hitting the surface
-            // const hit_record& rec   <- Information about the hit point (position, normal, etc.)
-            // color& attenuation      <- How much light the material absorbs or reflects
-            // ray& scattered          <- The scattered (reflected/refracted) ray        
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth-1, world);
+            if (pattern)
+                pattern->start_light(bounce);
+            incoming += sample_lights(r, rec, world);
+        }
+        return emission + attenuation * incoming;
+    }
+
+    // Light emitted by the surface hit by "r", weighted against sample_lights finding the same light
+    color emitted_light(const ray &r, const hit_record &rec, double scatter_pdf) const
+    {
+        color emission = rec.mat->emitted(r, rec);
+        if (scatter_pdf > 0 && lights && !emission.near_zero())
+            emission = mis_weight(scatter_pdf, light_fraction * lights->pdf_value(r.origin(), r.direction(), r.time())) * emission;
+        return emission;
+    }
+
+    // Light seen along a ray which escaped the scene, weighted against sample_lights picking the same
+    // direction of the environment map
+    color escaped_light(const ray &r, double scatter_pdf) const
+    {
+        color background = background_color(r);
+        if (scatter_pdf > 0 && environment)
+            background = mis_weight(scatter_pdf, (1 - light_fraction) * environment->pdf_value(r.direction())) * background;
+        return background;
+    }
+
+    /*
+        Next event estimation: the light arriving at the surface from a random point of a random light,
+        or from a direction of the environment map picked by how bright it is. The result is not yet
+        multiplied by the attenuation of the material (which is the same for every direction).
+        With both lights and an environment map, each sample goes to one of them (light_fraction), so
+        the density of a direction is the chance of that choice times the density of the light.
+    */
+    color sample_lights(const ray &r_in, const hit_record &rec, const hittable &world) const
+    {
+        if (!lights && !environment)
             return color(0,0,0);
+
+        bool to_environment = environment && (!lights || sample_1d() >= light_fraction);
+        auto direction = to_environment ? environment->random() : lights->random(rec.p, r_in.time());
+        ray to_light(rec.p, unit_vector(direction), r_in.time());
+        auto bsdf_pdf = rec.mat->scattering_pdf(r_in, rec, to_light);
+        if (bsdf_pdf <= 0)
+            return color(0,0,0);
+
+        // The shadow ray only needs to know if anything is between the surface and the light
+        double light_pdf;
+        color emitted;
+        if (to_environment)
+        {
+            light_pdf = (1 - light_fraction) * environment->pdf_value(to_light.direction());
+            if (light_pdf <= 0 || world.occluded(to_light, interval(0.001, infinity)))
+                return color(0,0,0);
+            emitted = environment->value(to_light.direction());
+        }
+        else
+        {
+            light_pdf = light_fraction * lights->pdf_value(rec.p, to_light.direction(), to_light.time());
+            hit_record light_rec;
+            if (light_pdf <= 0 || !lights->hit(to_light, interval(0.001, infinity), light_rec))
+                return color(0,0,0);
+            if (world.occluded(to_light, interval(0.001, light_rec.t - 0.001)))
+                return color(0,0,0);
+            emitted = light_rec.mat->emitted(to_light, light_rec);
         }
 
+        // Reflected light: emitted * BRDF * cos(θ), divided by the density of the direction
+        auto weight = mis_weight(light_pdf, bsdf_pdf) * bsdf_pdf / light_pdf;
+        return weight * emitted;
+    }
+
+    // Power heuristic: weight of a sample found with density pdf_a when a second strategy
+    // would have found it with density pdf_b
+    static double mis_weight(double pdf_a, double pdf_b)
+    {
+        auto a2 = pdf_a * pdf_a;
+        auto b2 = pdf_b * pdf_b;
+        return a2 / (a2 + b2);
+    }
+
+    // Color seen along a ray which doesn't hit anything
+    color background_color(const ray &r) const
+    {
+        if (environment)
+            return environment->value(r.direction());
+        if (black_background)
+            return color(0,0,0);
+
         // If the ray doesnt hit the sphere then do nothing and just put a edges to center liner blend
         // Linear blend:
         // blendedValue = (1 - x) * min_color_intensity + x * max_color_intensity
@@ -131,11 +397,19 @@ private:
         return (1.0 - a) * colorWhite + a * colorLightBlue;
     }
 
-    ray get_ray(int i, int j) const
+    // Points the sampler at the first dimension of sample "sample" of pixel (i, j)
+    void start_sample(int i, int j, int sample) const
+    {
+        if (auto pattern = sampler::current())
+            pattern->start(std::uint64_t(j) * image_width + i, sample);
+    }
+
+    ray get_ray(int i, int j, int sample) const
     {
         // Construct a camera ray originating from the origin and directed at randomly sampled
         // point around the pixel location i, j.
 
+        start_sample(i, j, sample);
         auto offset = sample_square();
         auto pixel_sample = pixel_upper_left_center + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
 
@@ -147,41 +421,653 @@ private:
         // - Objects exactly at this focus distance appear sharp.
         // - Objects closer or farther than the focus distance become blurred due to the way light rays spread.
 
-        auto ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample();
+        // The lens sample is always taken so the time below keeps its own sampler dimension
+        auto lens_sample = defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? camera_center : lens_sample;
         auto ray_direction = pixel_sample - ray_origin;
 
-        return ray(ray_origin, ray_direction);
+        // Motion blur: a real shutter stays open for a while and the image averages everything
+        // that happened in that time. Each ray is cast at a random moment while the shutter is open,
+        // and objects are hit where they are at that moment.
+        auto ray_time = shutter_open;
+        if (shutter_close > shutter_open)
+            ray_time += (shutter_close - shutter_open) * sample_1d();
+
+        return ray(ray_origin, ray_direction, ray_time);
+    }
+
+    // Traces one sample for every pixel of the block [i0, i0 + w) x [j0, j0 + h) as a single packet,
+    // and adds the colors to the image.
+    // Camera rays of neighbouring pixels are almost parallel, so they visit the same BVH nodes and
+    // hit the same objects: tracing them together shares the box tests. After the first hit the
+    // bounced rays go in random directions, so each of them continues alone with ray_color.
+    void trace_packet(int i0, int j0, int w, int h, int sample, const hittable &world)
+    {
+        ray_packet packet;
+        packet.size = w * h;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                packet.set_ray(y * w + x, get_ray(i0 + x, j0 + y, sample));
+
+        // Without defocus blur all camera rays start at the camera center, and every sample of the block
+        // goes through the rectangle covered by the block's pixels.
+        if (defocus_angle <= 0)
+        {
+            auto corner = pixel_upper_left_center + (i0 - 0.5) * pixel_delta_u + (j0 - 0.5) * pixel_delta_v;
+            vec3 corners[4] = {
+                corner - camera_center,
+                corner + w * pixel_delta_u - camera_center,
+                corner + w * pixel_delta_u + h * pixel_delta_v - camera_center,
+                corner + h * pixel_delta_v - camera_center,
+            };
+            packet.set_frustum(camera_center, corners);
+        }
+
+        unsigned char active[ray_packet::max_size];
+        for (int i = 0; i < packet.size; i++)
+            active[i] = 1;
+
+        packet_hits hits;
+        hits.reset(packet.size, infinity);
+        world.hit_packet(packet, active, 0.001, hits);
+
+        for (int i = 0; i < packet.size; i++)
+        {
+            ray r = packet.get_ray(i);
+            start_sample(i0 + i % w, j0 + i / w, sample);
+            auto pixel = size_t(j0 + i / w - region_y) * region_width + i0 + i % w - region_x;
+            if (hits.hit[i])
+            {
+                add_first_hit(frame, pixel, r, &hits.rec[i]);
+                add_sample(frame, pixel, sample, hit_color(r, hits.rec[i], max_depth, world));
+            }
+            else
+            {
+                add_first_hit(frame, pixel, r, nullptr);
+                add_sample(frame, pixel, sample, background_color(r));
+            }
+        }
     }
 
     point3 defocus_disk_sample() const {
         // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+        auto p = sample_in_unit_disk();
         return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
     // Returns the vector to a random point in the [-0.5, -0.5] - [+0.5, +0.5] unit square.
     vec3 sample_square() const
     {
-        // "random_double" returns a random number in range [0, 1]
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+        // "sample_2d" returns two numbers in range [0, 1)
+        auto u = sample_2d();
+        return vec3(u.x() - 0.5, u.y() - 0.5, 0);
+    }
+
+    // Packet mode: the image is traced in blocks of packet_size x packet_size pixels.
+    void render_packets(const hittable &world)
+    {
+        int block = packet_size * packet_size <= ray_packet::max_size ? packet_size : 8;
+        auto start = std::chrono::steady_clock::now();
+
+        for (int j0 = region_y; j0 < region_y + region_height; j0 += block)
+        {
+            std::clog << "\rScanlines remaining: " << (region_y + region_height - j0) << ' ' << std::flush;
+            int h = std::min(block, region_y + region_height - j0);
+            for (int i0 = region_x; i0 < region_x + region_width; i0 += block)
+            {
+                int w = std::min(block, region_x + region_width - i0);
+                for (int sample = first_sample; sample < first_sample + samples_per_pixel; sample++)
+                    trace_packet(i0, j0, w, h, sample, world);
+
+                // The pixels of a block are traced together, they share its time
+                if (frame.has(pass::time))
+                {
+                    auto share = lap(start) / (w * h);
+                    for (int y = 0; y < h; y++)
+                        for (int x = 0; x < w; x++)
+                            frame.add(pass::time, size_t(j0 + y - region_y) * region_width + i0 + x - region_x, share);
+                }
+            }
+        }
+
+        std::clog << "\rDone                  \n";
+    }
+
+    /*
+        Batched mode: instead of following one sample through all its bounces before starting the next,
+        batch_size samples advance together one bounce at a time ("wavefront" order):
+            1. generate the camera rays of the whole batch
+            2. trace all rays of the batch
+            3. shade all hits, the scattered rays form the batch of the next bounce
+        Between the bounces the batch can be sorted (sort_rays) so rays going through the same part
+        of the scene are traced one after the other.
+        The hits are grouped by kind of material before shading, so every material runs its scatter
+        code as one loop over all its hits (see scatter_batch in material.h).
+    */
+    void render_batched(const hittable &world)
+    {
+        size_t total = frame.pixel_count() * samples_per_pixel;
+
+        traversal_stats stats;
+        traversal_stats::scope collect(stats);
+
+        std::vector<path_state> paths, next;
+        std::vector<hit_record> records;
+        std::vector<material_kind> kinds;
+        std::vector<size_t> slot_path;      // Path of every position of the scatter batch
+        scatter_batch batch;
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t first = 0; first < total; first += batch_size)
+        {
+            size_t last = std::min(total, first + batch_size);
+            std::clog << "\rSamples remaining: " << (total - first) << "        " << std::flush;
+
+            // 1. Camera rays, every pixel gets samples_per_pixel consecutive items
+            paths.clear();
+            for (size_t item = first; item < last; item++)
+            {
+                // Paths carry the index of their pixel in the whole image, frame_pixel finds it in the region
+                auto local = item / samples_per_pixel;
+                auto sample = static_cast<std::uint32_t>(first_sample + item % samples_per_pixel);
+                int i = region_x + int(local % region_width);
+                int j = region_y + int(local / region_width);
+                auto pixel = std::uint64_t(j) * image_width + i;
+                path_state path = {get_ray(i, j, sample), color(1, 1, 1), pixel, sample, 0};
+                paths.push_back(path);
+            }
+
+            for (int depth = max_depth; depth > 0 && !paths.empty(); depth--)
+            {
+                // Camera rays are already coherent in pixel order, only the bounced rays are sorted
+                if (sort_rays && depth < max_depth)
+                    sort_paths(paths);
+
+                // 2. Trace, and count the hits on every kind of material
+                size_t kind_count[material_kind_count] = {};
+                records.resize(paths.size());
+                kinds.resize(paths.size());
+                for (size_t i = 0; i < paths.size(); i++)
+                {
+                    stats.rays++;
+                    if (world.hit(paths[i].r, interval(0.001, infinity), records[i]))
+                    {
+                        if (depth == max_depth)
+                            add_first_hit(frame, frame_pixel(paths[i].pixel), paths[i].r, &records[i]);
+                        add_sample(frame, frame_pixel(paths[i].pixel), paths[i].sample,
+                                   paths[i].throughput * emitted_light(paths[i].r, records[i], paths[i].scatter_pdf));
+                        kinds[i] = records[i].mat->kind();
+                        kind_count[int(kinds[i])]++;
+                    }
+                    else
+                    {
+                        if (depth == max_depth)
+                            add_first_hit(frame, frame_pixel(paths[i].pixel), paths[i].r, nullptr);
+                        add_sample(frame, frame_pixel(paths[i].pixel), paths[i].sample,
+                                   paths[i].throughput * escaped_light(paths[i].r, paths[i].scatter_pdf));
+                        kinds[i] = material_kind::generic;
+                        records[i].mat = nullptr;
+                    }
+                }
+
+                // Counting sort: every kind gets a contiguous range of the scatter batch
+                size_t kind_begin[material_kind_count + 1] = {};
+                for (int k = 0; k < material_kind_count; k++)
+                    kind_begin[k + 1] = kind_begin[k] + kind_count[k];
+
+                size_t next_slot[material_kind_count];
+                std::copy(kind_begin, kind_begin + material_kind_count, next_slot);
+                batch.resize(kind_begin[material_kind_count]);
+                slot_path.resize(kind_begin[material_kind_count]);
+                for (size_t i = 0; i < paths.size(); i++)
+                {
+                    if (!records[i].mat)
+                        continue;
+                    size_t s = next_slot[int(kinds[i])]++;
+                    batch.set_hit(s, paths[i].r, records[i]);
+                    batch.pixel[s] = paths[i].pixel;
+                    batch.sample[s] = paths[i].sample;
+                    slot_path[s] = i;
+                }
+
+                // 3. Shade one kind of material at a time
+                batch.bounce = max_depth - depth;
+                for (int k = 0; k < material_kind_count; k++)
+                    scatter_span(material_kind(k), batch, kind_begin[k], kind_begin[k + 1]);
+
+                // Build the next bounce, diffuse hits also collect the direct light
+                next.clear();
+                for (size_t s = 0; s < slot_path.size(); s++)
+                {
+                    if (!batch.scattered[s])
+                        continue;
+                    const path_state &path = paths[slot_path[s]];
+                    const hit_record &rec = records[slot_path[s]];
+                    path_state bounced = {ray(batch.p[s], batch.dir_out[s], batch.time[s]),
+                                          path.throughput * batch.attenuation[s], path.pixel, path.sample, 0};
+                    bounced.scatter_pdf = batch.mat[s]->scattering_pdf(path.r, rec, bounced.r);
+                    if (bounced.scatter_pdf > 0 && depth > 1)
+                    {
+                        if (auto pattern = sampler::current())
+                        {
+                            pattern->start(path.pixel, path.sample);
+                            pattern->start_light(batch.bounce);
+                        }
+                        add_sample(frame, frame_pixel(path.pixel), path.sample, bounced.throughput * sample_lights(path.r, rec, world));
+                    }
+                    next.push_back(bounced);
+                }
+                paths.swap(next);
+            }
+
+            // Every sample of the batch gets the same share of its time
+            if (frame.has(pass::time))
+            {
+                auto share = lap(start) / (last - first);
+                for (size_t item = first; item < last; item++)
+                    frame.add(pass::time, item / samples_per_pixel, share);
+            }
+        }
+
+        std::clog << "\rDone                          \n";
+        std::clog << "Rays traced: " << stats.rays
+                  << ", BVH nodes visited per ray: " << double(stats.node_visits) / stats.rays
+                  << ", simulated cache misses per ray: " << double(stats.cache_misses) / stats.rays
+                  << (sort_rays ? " (sorted)" : " (unsorted)") << '\n';
     }
 
 public:
     camera(const camera_config& config) : 
     aspect_ratio(config.aspect_ratio), 
     image_width(config.image_width), 
+    samples_per_pixel(config.samples_per_pixel),
     max_depth(config.max_depth),
     vfov(config.vfov),
     camera_lookfrom(config.camera_lookfrom),
     camera_lookat(config.camera_lookat),
     vup(config.vup),
     defocus_angle(config.defocus_angle),
-    focus_dist(config.focus_dist)
+    focus_dist(config.focus_dist),
+    shutter_open(config.shutter_open),
+    shutter_close(config.shutter_close),
+    packet_size(config.packet_size),
+    batch_size(config.batch_size),
+    sort_rays(config.sort_rays),
+    black_background(config.black_background),
+    environment(config.environment),
+    sampling(config.sampling),
+    denoise(config.denoise),
+    aovs(config.aovs),
+    aov_prefix(config.aov_prefix),
+    hdr_output(config.hdr_output),
+    png_output(config.png_output),
+    tile_size(config.tile_size),
+    tile_stream(config.tile_stream),
+    tile_output(config.tile_output),
+    crop(config.crop),
+    crop_background(config.crop_background),
+    workers(config.workers),
+    first_sample(config.first_sample),
+    accumulation_input(config.accumulation_input),
+    accumulation_output(config.accumulation_output)
     {}
 
     void render(const hittable &world)
+    {
+        render_scene(world, nullptr);
+    }
+
+    // Renders with explicit light sampling. "lights" holds the emissive objects of the world
+    // (usually the same shared_ptr objects added to both), each of them must implement pdf_value and random.
+    void render(const hittable &world, const hittable &lights)
+    {
+        render_scene(world, &lights);
+    }
+
+private:
+    void render_scene(const hittable &world, const hittable *light_list)
     {
         initialize();
+        lights = light_list;
+        light_fraction = lights ? (environment ? 0.5 : 1.0) : 0.0;
+
+        auto pixel_sampler = sampler::create(sampling, samples_per_pixel, image_width);
+        sampler::scope use_sampler(*pixel_sampler);
+
+        // Every mode adds its samples to the image in memory, it is written once complete
+        std::vector<pass> passes = aovs;
+        if (denoise)
+        {
+            passes.push_back(pass::albedo);
+            passes.push_back(pass::normal);
+            passes.push_back(pass::odd_samples);
+        }
+
+        // Out of core: the tiles go straight to the output file, there is no image in memory to filter or write.
+        // The earlier samples and the sums go through the accumulation files a tile at a time as well.
+        if (!tile_output.empty())
+        {
+            if (denoise || !hdr_output.empty() || !png_output.empty() || (!aovs.empty() && accumulation_output.empty()))
+                std::clog << "With tile_output only '" << tile_output << "'"
+                          << (accumulation_output.empty() ? "" : " and '" + accumulation_output + "'")
+                          << " can be written (convert them with tonemap)\n";
+            render_tiles(world, accumulation_output.empty() ? std::vector<pass>() : aovs);
+            return;
+        }
+        frame.reset(region_width, region_height, passes);
+        if (!accumulation_input.empty())
+        {
+            // The denoiser takes half of the samples of every pixel (rounded down) to be odd
+            if (denoise && samples_per_pixel % 2 != 0)
+                std::clog << "Topped up with an odd number of samples per pixel, the denoiser misjudges the noise\n";
+            load_accumulation();
+        }
+
+        // The tile settings come first: they change where the output goes (a stream, worker processes),
+        // packets and batches only change the order the rays are traced in
+        if (tile_size > 0 || !tile_stream.empty() || workers > 0)
+        {
+            if (batch_size > 0 || packet_size > 0)
+                std::clog << "Tile mode traces the rays of every tile one at a time, packet_size and batch_size are ignored\n";
+            render_tiles(world, passes);
+        }
+        else if (batch_size > 0)
+            render_batched(world);
+        else if (packet_size > 0 && max_depth > 0)
+            render_packets(world);
+        else
+            render_scanlines(world);
+
+        if (!accumulation_output.empty() && write_accumulation(accumulation_output, frame))
+            std::clog << "Wrote '" << accumulation_output << "'\n";
+        write_image();
+    }
+
+    // Starts from the samples of accumulation_input, which must be of the same image (or crop window)
+    void load_accumulation()
+    {
+        framebuffer earlier;
+        if (!read_accumulation(accumulation_input, earlier))
+            std::cerr << "ERROR: Could not load '" << accumulation_input << "'.\n";
+        else if (earlier.width() != frame.width() || earlier.height() != frame.height())
+            std::cerr << "ERROR: '" << accumulation_input << "' is " << earlier.width() << " x " << earlier.height()
+                      << ", not " << frame.width() << " x " << frame.height() << ".\n";
+        else
+            frame.accumulate(earlier);
+    }
+
+    void render_scanlines(const hittable &world)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int j = region_y; j < region_y + region_height; j++)
+        {
+            std::clog << "\rScanlines remaining: " << (region_y + region_height - j) << ' ' << std::flush;
+            for (int i = region_x; i < region_x + region_width; i++)
+            {
+                auto pixel = size_t(j - region_y) * region_width + (i - region_x);
+                render_pixel(i, j, world, frame, pixel);
+                if (frame.has(pass::time))
+                    frame.add(pass::time, pixel, lap(start));
+            }
+        }
+
+        std::clog << "\rDone                  \n";
+    }
+
+    // Renders the samples of pixel i, j into pixel "pixel" of "target"
+    void render_pixel(int i, int j, const hittable &world, framebuffer &target, size_t pixel)
+    {
+        // Anti-Aliasing using supersampling technique
+        // Rendered images often show jagged edges, known as aliasing, due to point sampling.
+        // Real - world images appear smooth because they blend foreground and background colors.
+        // To mimic this, we average multiple samples per pixel, simulating how our eyes perceive distant details.
+        // A simple approach is to sample light within a pixel’s surrounding area to approximate a continuous image.
+        for (int sample = first_sample; sample < first_sample + samples_per_pixel; sample++)
+        {
+            ray r = get_ray(i, j, sample);
+            add_sample(target, pixel, sample, camera_ray_color(r, target, pixel, world));
+        }
+    }
+
+    /*
+        Tile mode: the image is cut into square tiles which are rendered on all threads, or in worker
+        processes (see worker_pool.h), each finished tile going to the tile stream right away (see tile_stream.h).
+        Every tile is rendered into a framebuffer of its own and then added to the image, or with
+        tile_output written straight to the file and forgotten, so only the tiles being rendered are
+        in memory (a few megabytes per thread, for an image of any size). Then every tile starts from its part
+        of accumulation_input, and its sums go to its part of accumulation_output.
+        A sampler keeps track of where it is in the current sample, every tile gets its own.
+        With a crop window the tiles cover the region, and the stream holds the region alone. So does tile_output,
+        unless there is a crop_background: the file is then the whole image, the background with the tiles over it.
+    */
+    void render_tiles(const hittable &world, const std::vector<pass> &passes)
+    {
+        int size = tile_size > 0 ? tile_size : 32;
+        int columns = (region_width + size - 1) / size;
+        int rows = (region_height + size - 1) / size;
+
+        tile_stream_writer stream;
+        if (!tile_stream.empty() && !stream.open(tile_stream, region_width, region_height))
+            std::cerr << "ERROR: Could not open tile stream '" << tile_stream << "'.\n";
+
+        pfm_tile_writer output;
+        int output_x = region_x, output_y = region_y;   // Where the top left corner of the file is in the image
+        if (!tile_output.empty() && !open_tile_output(output, output_x, output_y))
+        {
+            std::cerr << "ERROR: Could not write '" << tile_output << "'.\n";
+            return;
+        }
+
+        accumulation_tile_file earlier, sums;
+        if (output.is_open() && !accumulation_input.empty())
+        {
+            if (!earlier.open(accumulation_input))
+                std::cerr << "ERROR: Could not load '" << accumulation_input << "'.\n";
+            else if (earlier.width() != region_width || earlier.height() != region_height)
+            {
+                std::cerr << "ERROR: '" << accumulation_input << "' is " << earlier.width() << " x " << earlier.height()
+                          << ", not " << region_width << " x " << region_height << ".\n";
+                earlier.close();
+            }
+        }
+        if (output.is_open() && !accumulation_output.empty() &&
+            !sums.create(accumulation_output, region_width, region_height, passes))
+            std::cerr << "ERROR: Could not write '" << accumulation_output << "'.\n";
+        const accumulation_tile_file *start = earlier.is_open() ? &earlier : nullptr;
+
+        std::vector<work_item> tiles;
+        for (int t = 0; t < columns * rows; t++)
+        {
+            int x0 = region_x + (t % columns) * size;
+            int y0 = region_y + (t / columns) * size;
+            tiles.push_back({x0, y0, std::min(size, region_x + region_width - x0), std::min(size, region_y + region_height - y0)});
+        }
+
+        // What happens to a finished tile, wherever it was rendered
+        std::atomic<int> remaining(columns * rows);
+        std::atomic<bool> write_failed(false), sums_failed(false);
+        std::mutex progress;
+        auto finish = [&](const framebuffer &tile, int x0, int y0) {
+            if (stream.is_open())
+                stream.write_tile(tile, x0 - region_x, y0 - region_y, samples_per_pixel);
+
+            if (output.is_open())
+            {
+                auto rgb = tile.resolve(pass::beauty);
+                if (!output.write(x0 - output_x, y0 - output_y, tile.width(), tile.height(),
+                                  {&rgb[0], &rgb[tile.pixel_count()], &rgb[2 * tile.pixel_count()]}))
+                    write_failed = true;
+                if (sums.is_open() && !sums.write_tile(tile, x0 - region_x, y0 - region_y))
+                    sums_failed = true;
+            }
+            else
+                frame.accumulate(tile, x0 - region_x, y0 - region_y);
+
+            std::lock_guard<std::mutex> lock(progress);
+            std::clog << "\rTiles remaining: " << --remaining << ' ' << std::flush;
+        };
+
+        if (workers > 0)
+        {
+            // The tiles travel between the processes as the raw planes of their framebuffer
+            framebuffer pixel;
+            pixel.reset(1, 1, passes);
+            bool ok = worker_pool::run(workers, tiles, pixel.raw().size(),
+                [&](const work_item &t) { return render_tile(t, world, passes, start).raw(); },
+                [&](const work_item &t, std::vector<float> &planes) {
+                    framebuffer tile;
+                    tile.reset(t.width, t.height, passes);
+                    if (planes.size() == tile.raw().size())
+                    {
+                        tile.raw().swap(planes);
+                        finish(tile, t.x, t.y);
+                    }
+                    else
+                        std::cerr << "ERROR: Tile at " << t.x << ", " << t.y << " came back with the wrong size.\n";
+                });
+            if (!ok)
+                std::cerr << "ERROR: The image is incomplete.\n";
+        }
+        else
+        {
+            parallel_for(0, int(tiles.size()), [&](int t) {
+                finish(render_tile(tiles[t], world, passes, start), tiles[t].x, tiles[t].y);
+            });
+        }
+
+        std::clog << "\rDone                  \n";
+        if (output.is_open())
+        {
+            if (!output.close() || write_failed)
+                std::cerr << "ERROR: Could not write '" << tile_output << "'.\n";
+            else
+                std::clog << "Wrote '" << tile_output << "'\n";
+        }
+        if (sums.is_open())
+        {
+            if (!sums.close() || sums_failed)
+                std::cerr << "ERROR: Could not write '" << accumulation_output << "'.\n";
+            else
+                std::clog << "Wrote '" << accumulation_output << "'\n";
+        }
+    }
+
+    // Opens tile_output over the region or, with crop_background, over the whole image with the background
+    // copied into it a band of rows at a time (the background is never all in memory if it is a PFM).
+    // x and y are set to where the top left corner of the file is in the image.
+    bool open_tile_output(pfm_tile_writer &output, int &x, int &y) const
+    {
+        x = region_x;
+        y = region_y;
+        if (!crop_background.empty() && size_t(region_width) * region_height < size_t(image_width) * image_height)
+        {
+            float_image_reader background;
+            if (!background.open(crop_background))
+                std::cerr << "ERROR: Could not load image '" << crop_background << "'.\n";
+            else if (background.width() != image_width || background.height() != image_height)
+                std::cerr << "ERROR: '" << crop_background << "' is " << background.width() << " x "
+                          << background.height() << ", not " << image_width << " x " << image_height << ".\n";
+            else
+            {
+                if (!output.open(tile_output, image_width, image_height))
+                    return false;
+                const int band = 64;
+                std::vector<color> pixels;
+                for (int j = 0; j < image_height; j += band)
+                {
+                    int count = std::min(band, image_height - j);
+                    if (!background.read_rows(j, count, pixels))
+                    {
+                        std::cerr << "ERROR: Could not load image '" << crop_background << "'.\n";
+                        return false;
+                    }
+                    std::vector<float> rgb(3 * pixels.size());
+                    for (size_t pixel = 0; pixel < pixels.size(); pixel++)
+                        for (int c = 0; c < 3; c++)
+                            rgb[c * pixels.size() + pixel] = float(pixels[pixel][c]);
+                    if (!output.write(0, j, image_width, count, {&rgb[0], &rgb[pixels.size()], &rgb[2 * pixels.size()]}))
+                        return false;
+                }
+                x = 0;
+                y = 0;
+                return true;
+            }
+        }
+        return output.open(tile_output, region_width, region_height);
+    }
+
+    // Renders the pixels of tile t into a framebuffer of its size, on top of its earlier samples if there are
+    framebuffer render_tile(const work_item &t, const hittable &world, const std::vector<pass> &passes,
+                            const accumulation_tile_file *earlier)
+    {
+        framebuffer tile;
+        tile.reset(t.width, t.height, passes);
+        if (earlier && !earlier->read_tile(tile, t.x - region_x, t.y - region_y))
+            std::cerr << "ERROR: Could not load the samples of the tile at " << t.x << ", " << t.y
+                      << " from '" << accumulation_input << "'.\n";
+        auto tile_sampler = sampler::create(sampling, samples_per_pixel, image_width);
+        sampler::scope use_sampler(*tile_sampler);
+        auto start = std::chrono::steady_clock::now();
+        for (int j = t.y; j < t.y + t.height; j++)
+            for (int i = t.x; i < t.x + t.width; i++)
+            {
+                auto pixel = size_t(j - t.y) * t.width + (i - t.x);
+                render_pixel(i, j, world, tile, pixel);
+                if (tile.has(pass::time))
+                    tile.add(pass::time, pixel, lap(start));
+            }
+        return tile;
+    }
+
+    // Seconds since "start", which is moved to now
+    static double lap(std::chrono::steady_clock::time_point &start)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto seconds = std::chrono::duration<double>(now - start).count();
+        start = now;
+        return seconds;
+    }
+
+    // Writes the average of the samples of every pixel, through the denoiser if it is on, and the other passes.
+    // The output is the rendered region, which is the whole image unless there is a crop window, or the whole
+    // image when the region is pasted into crop_background.
+    void write_image() const
+    {
+        std::vector<color> image(frame.pixel_count());
+        if (denoise)
+        {
+            std::clog << "Denoising..." << std::flush;
+            image = denoise_image(frame);
+            std::clog << "\rDenoised       \n";
+        }
+        else
+        {
+            for (size_t pixel = 0; pixel < frame.pixel_count(); pixel++)
+                image[pixel] = frame.value(pass::beauty, pixel);
+        }
+
+        int width = region_width, height = region_height;
+        bool whole_image = false;
+        if (!crop_background.empty() && frame.pixel_count() < size_t(image_width) * image_height)
+        {
+            std::vector<color> background;
+            int w, h;
+            if (!read_image(crop_background, w, h, background))
+                std::cerr << "ERROR: Could not load image '" << crop_background << "'.\n";
+            else if (w != image_width || h != image_height)
+                std::cerr << "ERROR: '" << crop_background << "' is " << w << " x " << h << ", not "
+                          << image_width << " x " << image_height << ".\n";
+            else
+            {
+                for (int j = 0; j < region_height; j++)
+                    std::copy(&image[size_t(j) * region_width], &image[size_t(j) * region_width] + region_width,
+                              &background[size_t(region_y + j) * image_width + region_x]);
+                image.swap(background);
+                width = image_width;
+                height = image_height;
+                whole_image = true;
+            }
+        }
 
         // P3 image format
         // P3 is a plain text format for Portable Pixmap (PPM) image files.
@@ -191,31 +1077,81 @@ public:
         // The second line contains the width and height of the image.
         // The third line specifies the maximum color value (typically 255, representing the maximum intensity for each color channel).
         // Each subsequent line contains three integers (r, g, b) for each pixel's color in the image.
-        std::cout << "P3\n";
-        std::cout << image_width << ' ' << image_height << '\n';
-        std::cout << "255\n";
-
-        for (int j = 0; j < image_height; j++)
+        // (Not when the tiles were streamed to std::cout instead.)
+        if (tile_stream != "-")
         {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (int i = 0; i < image_width; i++)
+            std::cout << "P3\n";
+            std::cout << width << ' ' << height << '\n';
+            std::cout << "255\n";
+            write_colors(std::cout, image, width);
+        }
+
+        if (!hdr_output.empty())
+            write_hdr_output(image, width, height, whole_image);
+        if (!png_output.empty() && write_png(png_output, width, height, color_bytes(image)))
+            std::clog << "Wrote '" << png_output << "'\n";
+        write_aovs(width, height, whole_image);
+    }
+
+    // Final values of a pass, one plane per channel, for the region or placed in the whole image (zero around it)
+    std::vector<float> output_planes(pass p, bool whole_image) const
+    {
+        auto planes = frame.resolve(p);
+        if (!whole_image)
+            return planes;
+
+        auto pixels = size_t(image_width) * image_height;
+        std::vector<float> placed(framebuffer::channels(p) * pixels, 0.0f);
+        for (int c = 0; c < framebuffer::channels(p); c++)
+            for (int j = 0; j < region_height; j++)
             {
-                color pixel_color(0, 0, 0);
-                // Anti-Aliasing using supersampling technique
-                // Rendered images often show jagged edges, known as aliasing, due to point sampling.
-                // Real - world images appear smooth because they blend foreground and background colors.
-                // To mimic this, we average multiple samples per pixel, simulating how our eyes perceive distant details.
-                // A simple approach is to sample light within a pixel’s surrounding area to approximate a continuous image.                                                                                                                                                                                                                              
-                for (int sample = 0; sample < samples_per_pixel; sample++)
-                {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
+                const float *from = &planes[c * frame.pixel_count() + size_t(j) * region_width];
+                std::copy(from, from + region_width, &placed[c * pixels + size_t(region_y + j) * image_width + region_x]);
             }
+        return placed;
+    }
+
+    // The image as R, G and B planes, followed by the channels of the other passes
+    void write_hdr_output(const std::vector<color> &image, int width, int height, bool whole_image) const
+    {
+        auto pixels = image.size();
+        std::vector<float> rgb(3 * pixels);
+        for (size_t pixel = 0; pixel < pixels; pixel++)
+            for (int c = 0; c < 3; c++)
+                rgb[c * pixels + pixel] = float(image[pixel][c]);
+
+        std::vector<exr_channel> channels;
+        for (int c = 0; c < 3; c++)
+            channels.push_back({framebuffer::channel_name(pass::beauty, c), &rgb[c * pixels]});
+
+        std::vector<std::vector<float>> passes;
+        passes.reserve(aovs.size());
+        for (auto p : aovs)
+        {
+            passes.push_back(output_planes(p, whole_image));
+            for (int c = 0; c < framebuffer::channels(p); c++)
+                channels.push_back({framebuffer::channel_name(p, c), &passes.back()[c * pixels]});
         }
 
-        std::clog << "\rDone                  \n";
+        if (write_float_image(hdr_output, width, height, channels))
+            std::clog << "Wrote '" << hdr_output << "'\n";
+    }
+
+    void write_aovs(int width, int height, bool whole_image) const
+    {
+        if (aov_prefix.empty())
+            return;
+        for (auto p : aovs)
+        {
+            auto planes = output_planes(p, whole_image);
+            std::vector<const float *> channels;
+            for (int c = 0; c < framebuffer::channels(p); c++)
+                channels.push_back(&planes[c * size_t(width) * height]);
+
+            auto filename = aov_prefix + framebuffer::name(p) + ".pfm";
+            if (write_pfm(filename, width, height, channels))
+                std::clog << "Wrote '" << filename << "'\n";
+        }
     }
 };
 
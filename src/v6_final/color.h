@@ -1,8 +1,13 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include "parallel.h"
 #include "vec3.h"
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 using color = vec3;
 
 // In real-world physics, light intensity follows a linear scale.
@@ -26,6 +31,12 @@ void write_color(std::ostream &out, const color &pixel_color)
     g = linear_to_gamma(g);
     b = linear_to_gamma(b);    
 
+    // Lights make the sum of the samples go above 1 (and a rare bad sample can be NaN),
+    // clamp to [0, 0.999] so every component stays a valid byte.
+    r = r == r ? std::fmin(std::fmax(r, 0.0), 0.999) : 0.0;
+    g = g == g ? std::fmin(std::fmax(g, 0.0), 0.999) : 0.0;
+    b = b == b ? std::fmin(std::fmax(b, 0.0), 0.999) : 0.0;
+
     // Translate the [0,1] component values to the byte range [0,255].
     int rbyte = int(255.999 * r);
     int gbyte = int(255.999 * g);
@@ -35,4 +46,123 @@ void write_color(std::ostream &out, const color &pixel_color)
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
 
+/*
+    Gamma table
+    write_color calls pow() three times per pixel, which is most of the time spent writing a large image.
+    The byte of a component only changes at 255 linear values, so the table stores these thresholds
+    (threshold[b] is the smallest linear value written as b) and finds the byte with a lookup:
+        - a coarse table gives the byte at the start of one of 4096 equal steps over [0, 1]
+        - the gamma curve is steep near 0 and one step can span a few bytes there, a short walk up the
+          thresholds finishes the job (no steps at all for most values)
+    The thresholds are found by bisection on write_color's own formula, so the bytes are exactly the same
+    (except for -infinity, which pow() turns into white and the table into black).
+*/
+class gamma_table
+{
+public:
+    static const gamma_table &instance()
+    {
+        static const gamma_table table;
+        return table;
+    }
+
+    int byte(double linear) const
+    {
+        if (!(linear > 0))      // Also NaN
+            return 0;
+        if (linear >= threshold[255])
+            return 255;
+        int b = coarse[int(linear * coarse_size)];
+        while (linear >= threshold[b + 1])
+            b++;
+        return b;
+    }
+
+private:
+    static const int coarse_size = 4096;
+    double threshold[256];
+    unsigned char coarse[coarse_size];
+
+    // The byte write_color writes for a linear value
+    static int reference_byte(double linear)
+    {
+        auto g = linear_to_gamma(linear);
+        g = g == g ? std::fmin(std::fmax(g, 0.0), 0.999) : 0.0;
+        return int(255.999 * g);
+    }
+
+    gamma_table()
+    {
+        threshold[0] = 0;
+        for (int b = 1; b < 256; b++)
+        {
+            // reference_byte(lo) < b <= reference_byte(hi), until they are neighbouring doubles
+            double lo = 0, hi = 1;
+            for (;;)
+            {
+                double mid = lo + (hi - lo) / 2;
+                if (mid <= lo || mid >= hi)
+                    break;
+                (reference_byte(mid) >= b ? hi : lo) = mid;
+            }
+            threshold[b] = hi;
+        }
+        for (int k = 0; k < coarse_size; k++)
+            coarse[k] = static_cast<unsigned char>(reference_byte(double(k) / coarse_size));
+    }
+};
+
+// The bytes of the pixels as write_color writes them, 3 per pixel (for binary formats, see png.h)
+inline std::vector<unsigned char> color_bytes(const std::vector<color> &pixels)
+{
+    const auto &table = gamma_table::instance();
+    std::vector<unsigned char> bytes(3 * pixels.size());
+    const int band = 4096;
+    parallel_for(0, int((pixels.size() + band - 1) / band), [&](int b) {
+        auto end = std::min(pixels.size(), size_t(b + 1) * band);
+        for (auto pixel = size_t(b) * band; pixel < end; pixel++)
+            for (int c = 0; c < 3; c++)
+                bytes[3 * pixel + c] = static_cast<unsigned char>(table.byte(pixels[pixel][c]));
+    });
+    return bytes;
+}
+
+// Writes the pixels of an image (rows of "width" pixels) exactly like write_color does one by one.
+// The text of a band of rows is built on all threads, using the gamma table, then written at once.
+inline void write_colors(std::ostream &out, const std::vector<color> &pixels, int width)
+{
+    const auto &table = gamma_table::instance();
+    int height = int(pixels.size() / width);
+    const int band = 64;
+    std::vector<std::string> rows(band);
+
+    for (int j0 = 0; j0 < height; j0 += band)
+    {
+        int rows_in_band = std::min(band, height - j0);
+        parallel_for(0, rows_in_band, [&](int y) {
+            auto &text = rows[y];
+            text.resize(size_t(width) * 12);    // "255 255 255\n" at most
+            char *p = &text[0];
+            const color *row = &pixels[size_t(j0 + y) * width];
+            for (int i = 0; i < width; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    int v = table.byte(row[i][c]);
+                    if (v >= 100)
+                        *p++ = char('0' + v / 100);
+                    if (v >= 10)
+                        *p++ = char('0' + v / 10 % 10);
+                    *p++ = char('0' + v % 10);
+                    *p++ = c < 2 ? ' ' : '\n';
+                }
+            }
+            text.resize(p - &text[0]);
+        });
+
+        for (int y = 0; y < rows_in_band; y++)
+            out.write(rows[y].data(), rows[y].size());
+    }
+}
+
 #endif
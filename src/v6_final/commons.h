@@ -1,6 +1,7 @@
 #ifndef COMMONS_H
 #define COMMONS_H
 
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include <limits>
@@ -23,11 +24,20 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+// The random number generator of the current thread, threads sharing one would race on its state.
+// The first thread to ask gets the default seed (the same numbers as a single generator), the others
+// their own seeds.
+inline std::mt19937 &random_generator()
+{
+    static std::atomic<unsigned int> threads(0);
+    static thread_local std::mt19937 generator(std::mt19937::default_seed + threads++);
+    return generator;
+}
+
 inline double random_double()
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator());
 }
 
 inline double random_double(double min, double max)
@@ -0,0 +1,166 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "commons.h"
+#include "framebuffer.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <vector>
+
+struct denoise_settings
+{
+    int iterations = 5;             // Passes of the filter, the last one reaches 2 * 2^(iterations - 1) pixels away
+    double sigma_luminance = 4;     // Brightness differences tolerated, in standard deviations of the noise
+    double sigma_normal = 0.3;      // Normal differences tolerated (0.3 is about 17 degrees)
+    double sigma_albedo = 0.1;      // Albedo differences tolerated
+};
+
+/*
+    Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010, with the variance guided
+    brightness weight of SVGF, Schied et al. 2017)
+    Noise is removed by averaging every pixel with its neighbours, and the trick is to only average
+    pixels that show the same thing. Each neighbour q of pixel p gets a weight that drops quickly when
+        - q is seen on a surface with a different normal (another face of a box, the edge of a sphere)
+        - q is seen on a surface with a different albedo (a texture, another object)
+        - q is brighter or darker than p by more than the noise can explain (a shadow, a highlight)
+    A wide blur is made of several passes of a small 5x5 kernel whose taps are spread further apart
+    every pass (1, 2, 4, 8... pixels, "à trous" means "with holes"), so the cost doesn't grow with the radius.
+    The filter works on the lighting alone: the image is divided by the albedo first and multiplied back
+    at the end, so textures stay sharp even where the lighting is blurred.
+
+    The guides are the albedo and normal passes of the framebuffer, which also needs the odd_samples pass.
+    These are nearly free of noise even at a few samples per pixel, and they show where the edges of the
+    scene are, which the noisy image alone can't tell apart from noise.
+    The result is the denoised average of every pixel, the rows are filtered on all threads.
+*/
+inline std::vector<color> denoise_image(const framebuffer &frame, const denoise_settings &settings = denoise_settings())
+{
+    int width = frame.width();
+    int height = frame.height();
+    auto pixels = frame.pixel_count();
+    auto luminance = [](const color &c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); };
+    const float *sample_count = frame.plane(pass::sample_count);
+
+    // Averages, and the lighting without the albedo
+    std::vector<color> albedo(pixels), divisor(pixels), light(pixels);
+    std::vector<vec3> normal(pixels);
+    bool single_sample = false;
+    for (size_t p = 0; p < pixels; p++)
+    {
+        albedo[p] = frame.value(pass::albedo, p);
+        normal[p] = frame.value(pass::normal, p);
+        // Black or nearly black channels can't be divided by, they are filtered as they are
+        divisor[p] = color(albedo[p].x() > 0.01 ? albedo[p].x() : 1,
+                           albedo[p].y() > 0.01 ? albedo[p].y() : 1,
+                           albedo[p].z() > 0.01 ? albedo[p].z() : 1);
+        light[p] = frame.value(pass::beauty, p) / divisor[p];
+        single_sample = single_sample || sample_count[p] < 2;
+    }
+
+    // Variance of the brightness of every pixel average. The even and odd samples are two independent
+    // estimates of the pixel, their difference d has a variance of σ²(1/n_even + 1/n_odd) for samples of
+    // variance σ², and the average of all samples has a variance of σ²/n.
+    std::vector<double> variance(pixels, 0.0);
+    if (!single_sample)
+    {
+        for (size_t p = 0; p < pixels; p++)
+        {
+            auto count = sample_count[p];
+            auto odd_count = std::floor(count / 2);
+            auto even_count = count - odd_count;
+            auto odd_sum = frame.sum(pass::odd_samples, p);
+            auto odd = odd_sum / odd_count;
+            auto even = (frame.sum(pass::beauty, p) - odd_sum) / even_count;
+            auto d = luminance(odd / divisor[p]) - luminance(even / divisor[p]);
+            variance[p] = d * d / (count * (1.0 / even_count + 1.0 / odd_count));
+        }
+    }
+    else
+    {
+        // A single sample in some pixels: use the spread of the brightness around the pixel instead
+        parallel_for(0, height, [&](int j) {
+            for (int i = 0; i < width; i++)
+            {
+                double sum = 0, sum_sq = 0;
+                int count = 0;
+                for (int y = std::max(0, j - 3); y <= std::min(height - 1, j + 3); y++)
+                    for (int x = std::max(0, i - 3); x <= std::min(width - 1, i + 3); x++)
+                    {
+                        auto l = luminance(light[size_t(y) * width + x]);
+                        sum += l;
+                        sum_sq += l * l;
+                        count++;
+                    }
+                auto mean = sum / count;
+                variance[size_t(j) * width + i] = std::fmax(0.0, sum_sq / count - mean * mean);
+            }
+        });
+    }
+
+    const double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+    const double blur[3] = {1.0 / 4, 1.0 / 2, 1.0 / 4};
+    auto inv_normal = 1.0 / (settings.sigma_normal * settings.sigma_normal);
+    auto inv_albedo = 1.0 / (settings.sigma_albedo * settings.sigma_albedo);
+
+    std::vector<color> filtered(pixels);
+    std::vector<double> filtered_variance(pixels);
+    for (int iteration = 0; iteration < settings.iterations; iteration++)
+    {
+        int step = 1 << iteration;
+        parallel_for(0, height, [&](int j) {
+            for (int i = 0; i < width; i++)
+            {
+                auto p = size_t(j) * width + i;
+
+                // The variance of a single pixel is itself noisy, a small blur steadies it
+                double local_variance = 0;
+                for (int y = -1; y <= 1; y++)
+                    for (int x = -1; x <= 1; x++)
+                    {
+                        int yy = std::min(height - 1, std::max(0, j + y));
+                        int xx = std::min(width - 1, std::max(0, i + x));
+                        local_variance += blur[x + 1] * blur[y + 1] * variance[size_t(yy) * width + xx];
+                    }
+                auto sigma = settings.sigma_luminance * std::sqrt(local_variance) + 1e-6;
+                auto lp = luminance(light[p]);
+
+                color sum(0, 0, 0);
+                double weight_sum = 0, variance_sum = 0;
+                for (int y = -2; y <= 2; y++)
+                {
+                    int qj = j + y * step;
+                    if (qj < 0 || qj >= height)
+                        continue;
+                    for (int x = -2; x <= 2; x++)
+                    {
+                        int qi = i + x * step;
+                        if (qi < 0 || qi >= width)
+                            continue;
+                        auto q = size_t(qj) * width + qi;
+
+                        auto w = kernel[x + 2] * kernel[y + 2]
+                               * std::exp(-std::fabs(lp - luminance(light[q])) / sigma
+                                          - (normal[p] - normal[q]).length_squared() * inv_normal
+                                          - (albedo[p] - albedo[q]).length_squared() * inv_albedo);
+                        sum += w * light[q];
+                        weight_sum += w;
+                        variance_sum += w * w * variance[q];
+                    }
+                }
+
+                // p itself always has a weight of (3/8)², weight_sum is never 0
+                filtered[p] = sum / weight_sum;
+                filtered_variance[p] = variance_sum / (weight_sum * weight_sum);
+            }
+        });
+        light.swap(filtered);
+        variance.swap(filtered_variance);
+    }
+
+    for (size_t p = 0; p < pixels; p++)
+        light[p] = light[p] * divisor[p];
+    return light;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "commons.h"
+#include "image_io.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    Environment map
+    An HDR image wrapped around the whole scene, giving the light of every direction a ray can escape to
+    (sky, sun, a photographed room...). The image is a latitude-longitude map:
+        column u = φ / 2π     with φ the angle around the vertical axis, from the -x axis
+        row    v = θ / π      with θ the angle from straight up (+y), row 0 is the top of the image
+    A bright sun covers a handful of pixels but gives most of the light. Scattered rays only find it by
+    chance, so the map can also be sampled directly: every pixel is picked with a probability
+    proportional to how much light it sends, and camera.h weighs these samples against scattered rays.
+*/
+class environment_map
+{
+public:
+    // Image in row-major order, width * height colors, top row first
+    environment_map(int width, int height, std::vector<color> pixels, double scale = 1.0)
+        : width(width), height(height), pixels(std::move(pixels))
+    {
+        for (auto &pixel : this->pixels)
+            pixel = scale * pixel;
+        build_sampling_table();
+    }
+
+    // Loads a PFM (.pfm), Radiance HDR (.hdr) or OpenEXR (.exr) image, returns nullptr if the file can't be read
+    static shared_ptr<environment_map> load(const std::string &filename, double scale = 1.0)
+    {
+        int w = 0, h = 0;
+        std::vector<color> image;
+        if (!read_image(filename, w, h, image))
+        {
+            std::cerr << "ERROR: Could not load environment map '" << filename << "'.\n";
+            return nullptr;
+        }
+
+        std::clog << "Loaded '" << filename << "': " << w << "x" << h << " environment map\n";
+        return make_shared<environment_map>(w, h, std::move(image), scale);
+    }
+
+    // Light coming from "direction"
+    color value(const vec3 &direction) const
+    {
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        return pixels[pixel_index(u, v)];
+    }
+
+    // Probability density (per unit solid angle) of random() returning "direction"
+    double pdf_value(const vec3 &direction) const
+    {
+        if (total_weight <= 0)
+            return 0;
+
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        return pdf_uv(pixel_pdf[pixel_index(u, v)], v);
+    }
+
+    // Random direction, picked with a probability proportional to the light of the map
+    vec3 random() const
+    {
+        if (total_weight <= 0)
+            return vec3(0, 1, 0);
+
+        // Alias method: one uniform pick of a pixel, then either keep it or take its alias.
+        // The fraction left over from the pick is uniform too, and decides between the two.
+        auto size = pixels.size();
+        auto pick = sample_1d() * size;
+        auto k = std::min(size - 1, static_cast<size_t>(pick));
+        if (pick - k >= keep[k])
+            k = alias[k];
+
+        // Uniform point inside the pixel
+        auto jitter = sample_2d();
+        auto u = (k % width + jitter.x()) / width;
+        auto v = (k / width + jitter.y()) / height;
+        return uv_to_direction(u, v);
+    }
+
+private:
+    int width, height;
+    std::vector<color> pixels;
+
+    // Sampling table: probability of picking every pixel, plus the alias table used to pick them in O(1)
+    std::vector<double> pixel_pdf;
+    std::vector<double> keep;
+    std::vector<std::uint32_t> alias;
+    double total_weight = 0;
+
+    size_t pixel_index(double u, double v) const
+    {
+        auto i = std::min(width - 1, static_cast<int>(u * width));
+        auto j = std::min(height - 1, static_cast<int>(v * height));
+        return size_t(j) * width + std::max(0, i);
+    }
+
+    static void direction_to_uv(const vec3 &d, double &u, double &v)
+    {
+        auto theta = std::acos(std::fmax(-1.0, std::fmin(1.0, d.y())));
+        auto phi = std::atan2(d.z(), d.x());
+        u = (phi + pi) / (2 * pi);
+        v = theta / pi;
+    }
+
+    static vec3 uv_to_direction(double u, double v)
+    {
+        auto phi = 2 * pi * u - pi;
+        auto theta = pi * v;
+        return vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    }
+
+    /*
+        From the probability of a pixel to a density per unit solid angle:
+        inside the pixel (u, v) is uniform, a density of p * width * height on the [0,1]² square.
+        The square covers φ ∈ [0, 2π) and θ ∈ [0, π], and a patch du dv covers the solid angle
+            dω = sin(θ) dθ dφ = 2π² sin(θ) du dv
+        so the density per unit solid angle is p * width * height / (2π² sin(θ)).
+        Rows near the poles are squeezed into a tiny solid angle, which is why the pixel weights
+        below include sin(θ): otherwise the poles would be sampled far more than the light they give.
+    */
+    double pdf_uv(double p, double v) const
+    {
+        auto sin_theta = std::sin(pi * v);
+        if (sin_theta <= 0)
+            return 0;
+        return p * width * height / (2 * pi * pi * sin_theta);
+    }
+
+    // Vose's alias method: every slot k keeps its own pixel with probability keep[k] and otherwise
+    // gives alias[k], which is set up so that each pixel ends up picked with probability pixel_pdf.
+    void build_sampling_table()
+    {
+        auto size = pixels.size();
+        pixel_pdf.assign(size, 0.0);
+        keep.assign(size, 1.0);
+        alias.resize(size);
+
+        total_weight = 0;
+        for (int j = 0; j < height; j++)
+        {
+            auto sin_theta = std::sin(pi * (j + 0.5) / height);
+            for (int i = 0; i < width; i++)
+            {
+                auto k = size_t(j) * width + i;
+                const color &c = pixels[k];
+                auto luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+                pixel_pdf[k] = std::fmax(0.0, luminance) * sin_theta;
+                total_weight += pixel_pdf[k];
+            }
+        }
+        if (total_weight <= 0)
+            return;
+
+        std::vector<double> scaled(size);
+        std::vector<std::uint32_t> small, large;
+        for (size_t k = 0; k < size; k++)
+        {
+            pixel_pdf[k] /= total_weight;
+            scaled[k] = pixel_pdf[k] * size;
+            alias[k] = static_cast<std::uint32_t>(k);
+            (scaled[k] < 1 ? small : large).push_back(static_cast<std::uint32_t>(k));
+        }
+
+        // Fill every under-full slot with the rest of an over-full one
+        while (!small.empty() && !large.empty())
+        {
+            auto s = small.back();
+            small.pop_back();
+            auto l = large.back();
+
+            keep[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // What's left is 1 up to rounding errors
+        for (auto k : small)
+            keep[k] = 1;
+        for (auto k : large)
+            keep[k] = 1;
+    }
+};
+
+#endif
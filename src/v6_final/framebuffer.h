@@ -0,0 +1,198 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "commons.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Everything a render can store per pixel. beauty and sample_count are always there, the others
+// (arbitrary output variables, "AOVs") only when asked for. All of them come from the same camera
+// rays: the first hit of every sample fills the AOVs on its way to computing the color.
+enum class pass
+{
+    beauty,         // Sum of the light of the samples
+    sample_count,   // Number of samples taken
+    odd_samples,    // Sum of the light of the odd-numbered samples, counting from the first one rendered (for the
+                    // denoiser, see denoise.h). Renders merged together must each have an even number of samples
+    depth,          // Distance to the closest surface seen in the pixel, infinity if none
+    normal,         // Average normal of the first surface hit, facing the camera, zero where nothing is hit
+    albedo,         // Average base_color() of the first surface hit, white where nothing is hit
+    material_id,    // material::id() of the surface hit by the first sample, 0 if nothing is hit
+    time            // Seconds spent rendering the pixel (a heat map of where the render time goes)
+};
+
+const int pass_count = 8;
+
+/*
+    Planar framebuffer
+    Every channel of every pass is a separate plane of width * height floats ("R R R ... G G G ... B B B"),
+    all in one block of memory. Floats halve the memory of doubles and are plenty for sums of samples,
+    and passes that are off take no space at all.
+    The planes hold raw sums, value() turns them into what the pass means (e.g. the average normal).
+*/
+class framebuffer
+{
+public:
+    // Allocates beauty, sample_count and the passes of "extra", all set to their empty value
+    void reset(int width, int height, const std::vector<pass> &extra)
+    {
+        w = width;
+        h = height;
+        for (int p = 0; p < pass_count; p++)
+            first_plane[p] = -1;
+
+        int planes = 0;
+        auto enable = [&](pass p) {
+            if (first_plane[int(p)] < 0)
+            {
+                first_plane[int(p)] = planes;
+                planes += channels(p);
+            }
+        };
+        enable(pass::beauty);
+        enable(pass::sample_count);
+        for (auto p : extra)
+            enable(p);
+
+        data.assign(pixel_count() * planes, 0.0f);
+        if (has(pass::depth))
+            std::fill(plane(pass::depth), plane(pass::depth) + pixel_count(), std::numeric_limits<float>::infinity());
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    size_t pixel_count() const { return size_t(w) * h; }
+
+    bool has(pass p) const { return first_plane[int(p)] >= 0; }
+
+    static int channels(pass p)
+    {
+        return p == pass::beauty || p == pass::odd_samples || p == pass::normal || p == pass::albedo ? 3 : 1;
+    }
+
+    static const char *name(pass p)
+    {
+        static const char *names[pass_count] = {
+            "beauty", "sample_count", "odd_samples", "depth", "normal", "albedo", "material_id", "time"};
+        return names[int(p)];
+    }
+
+    float *plane(pass p, int channel = 0) { return &data[(first_plane[int(p)] + channel) * pixel_count()]; }
+    const float *plane(pass p, int channel = 0) const { return &data[(first_plane[int(p)] + channel) * pixel_count()]; }
+
+    // All the planes one after the other, to send the framebuffer to another process (see worker_pool.h)
+    std::vector<float> &raw() { return data; }
+    const std::vector<float> &raw() const { return data; }
+
+    // Raw content of a pixel (a sum for most passes), the unused components are 0
+    vec3 sum(pass p, size_t pixel) const
+    {
+        vec3 v(0, 0, 0);
+        for (int c = 0; c < channels(p); c++)
+            v[c] = plane(p, c)[pixel];
+        return v;
+    }
+
+    // Final value of a pixel: averages for beauty, normal and albedo, the raw content for the others
+    vec3 value(pass p, size_t pixel) const
+    {
+        if (p != pass::beauty && p != pass::normal && p != pass::albedo)
+            return sum(p, pixel);
+        auto count = plane(pass::sample_count)[pixel];
+        return count > 0 ? sum(p, pixel) / count : vec3(0, 0, 0);
+    }
+
+    void add(pass p, size_t pixel, const vec3 &v)
+    {
+        for (int c = 0; c < channels(p); c++)
+            plane(p, c)[pixel] += float(v[c]);
+    }
+
+    void add(pass p, size_t pixel, double v) { plane(p)[pixel] += float(v); }
+    void set(pass p, size_t pixel, double v) { plane(p)[pixel] = float(v); }
+
+    // Keeps the smaller of v and what the pixel holds (for depth)
+    void keep_min(pass p, size_t pixel, double v)
+    {
+        if (v < plane(p)[pixel])
+            plane(p)[pixel] = float(v);
+    }
+
+    // Adds the samples of "other" to the rectangle at x, y (all of it by default): the sums of its passes
+    // multiplied by "weight", the closer depth, the material id if there is none yet, and the time.
+    // Into an empty framebuffer this is a copy, it pastes finished tiles into the image.
+    // Passes missing from either framebuffer are skipped.
+    void accumulate(const framebuffer &other, int x = 0, int y = 0, double weight = 1)
+    {
+        for (int p = 0; p < pass_count; p++)
+        {
+            auto which = pass(p);
+            if (!has(which) || !other.has(which))
+                continue;
+            for (int c = 0; c < channels(which); c++)
+                for (int j = 0; j < other.height(); j++)
+                {
+                    const float *from = other.plane(which, c) + size_t(j) * other.width();
+                    float *to = plane(which, c) + size_t(y + j) * w + x;
+                    for (int i = 0; i < other.width(); i++)
+                    {
+                        if (which == pass::depth)
+                            to[i] = std::min(to[i], from[i]);
+                        else if (which == pass::material_id)
+                            to[i] = to[i] != 0 ? to[i] : from[i];
+                        else if (which == pass::time)
+                            to[i] += from[i];
+                        else
+                            to[i] += float(weight * from[i]);
+                    }
+                }
+        }
+    }
+
+    // The passes besides beauty and sample_count
+    std::vector<pass> extra_passes() const
+    {
+        std::vector<pass> passes;
+        for (int p = int(pass::sample_count) + 1; p < pass_count; p++)
+            if (has(pass(p)))
+                passes.push_back(pass(p));
+        return passes;
+    }
+
+    // Final values of a pass, one plane per channel
+    std::vector<float> resolve(pass p) const
+    {
+        int n = channels(p);
+        std::vector<float> planes(n * pixel_count());
+        for (size_t pixel = 0; pixel < pixel_count(); pixel++)
+        {
+            auto v = value(p, pixel);
+            for (int c = 0; c < n; c++)
+                planes[c * pixel_count() + pixel] = float(v[c]);
+        }
+        return planes;
+    }
+
+    // Name of a channel in an OpenEXR file, with the usual names for color, depth and normals
+    static std::string channel_name(pass p, int channel)
+    {
+        static const char *rgb[3] = {"R", "G", "B"};
+        static const char *xyz[3] = {"X", "Y", "Z"};
+        switch (p)
+        {
+            case pass::beauty: return rgb[channel];
+            case pass::depth:  return "Z";
+            case pass::normal: return std::string("N.") + xyz[channel];
+            default:           return channels(p) == 3 ? std::string(name(p)) + "." + rgb[channel] : name(p);
+        }
+    }
+
+private:
+    int w = 0, h = 0;
+    int first_plane[pass_count] = {-1, -1, -1, -1, -1, -1, -1, -1}; // First plane of every pass, -1 if the pass is off
+    std::vector<float> data;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define HITTABLE_H
 
 #include "commons.h"
+#include "aabb.h"
 #include "interval.h"
 
 class material;
@@ -24,6 +25,134 @@ public:
     }
 };
 
+/*
+    Ray packet
+    A bundle of up to 64 rays (e.g. an 8x8 block of camera rays) traced through the scene together.
+    The rays are stored as a "structure of arrays": all origin x values next to each other, then all
+    origin y values, and so on. A loop doing the same math for every ray then reads consecutive
+    memory, which the compiler can turn into SIMD instructions working on several rays at once.
+
+    When all rays start at the same point (a pinhole camera), the packet also stores the frustum
+    (a pyramid of 4 planes through that point) containing every ray of the packet. A box completely
+    outside the frustum can't be hit by any ray, which is decided with 4 plane tests for the whole packet.
+*/
+class ray_packet
+{
+public:
+    static const int max_size = 64;
+
+    int size = 0;
+    double ox[max_size], oy[max_size], oz[max_size];                // Origins
+    double dx[max_size], dy[max_size], dz[max_size];                // Directions
+    double inv_dx[max_size], inv_dy[max_size], inv_dz[max_size];    // 1 / direction, for the slab tests
+    double time[max_size];
+
+    bool has_frustum = false;
+    point3 apex;                // Common origin of all the rays
+    vec3 frustum_normals[4];    // Inward facing normals of the 4 side planes
+
+    void set_ray(int i, const ray &r)
+    {
+        ox[i] = r.origin().x();
+        oy[i] = r.origin().y();
+        oz[i] = r.origin().z();
+        dx[i] = r.direction().x();
+        dy[i] = r.direction().y();
+        dz[i] = r.direction().z();
+        inv_dx[i] = 1.0 / dx[i];
+        inv_dy[i] = 1.0 / dy[i];
+        inv_dz[i] = 1.0 / dz[i];
+        time[i] = r.time();
+    }
+
+    ray get_ray(int i) const
+    {
+        return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), time[i]);
+    }
+
+    // Sets the frustum from the 4 corner directions (in order around the pyramid) of a bundle sharing
+    // the origin "apex". Every ray of the packet must point inside those corners.
+    void set_frustum(const point3 &origin, const vec3 corners[4])
+    {
+        apex = origin;
+        vec3 middle = corners[0] + corners[1] + corners[2] + corners[3];
+        for (int k = 0; k < 4; k++)
+        {
+            vec3 n = cross(corners[k], corners[(k + 1) % 4]);
+            frustum_normals[k] = dot(n, middle) < 0 ? -n : n;
+        }
+        has_frustum = true;
+    }
+
+    // True if the box is completely outside one of the frustum planes.
+    // For each plane only the box corner furthest along the normal has to be checked:
+    // if even that corner is behind the plane, the whole box is.
+    bool frustum_culls(const aabb &box) const
+    {
+        if (!has_frustum)
+            return false;
+        for (int k = 0; k < 4; k++)
+        {
+            const vec3 &n = frustum_normals[k];
+            point3 corner(n.x() > 0 ? box.x.max : box.x.min,
+                          n.y() > 0 ? box.y.max : box.y.min,
+                          n.z() > 0 ? box.z.max : box.z.min);
+            if (dot(n, corner - apex) < 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Slab test of the box against every active ray. Writes which rays enter the box
+    // into "inside" and returns true if at least one does.
+    // There is no early exit in the loop, so the compiler can vectorize it.
+    bool hit_box(const aabb &box, const unsigned char *active, double t_min, const double *t_max,
+                 unsigned char *inside) const
+    {
+        int any = 0;
+        for (int i = 0; i < size; i++)
+        {
+            double tx0 = (box.x.min - ox[i]) * inv_dx[i];
+            double tx1 = (box.x.max - ox[i]) * inv_dx[i];
+            double ty0 = (box.y.min - oy[i]) * inv_dy[i];
+            double ty1 = (box.y.max - oy[i]) * inv_dy[i];
+            double tz0 = (box.z.min - oz[i]) * inv_dz[i];
+            double tz1 = (box.z.max - oz[i]) * inv_dz[i];
+
+            double enter = t_min;
+            double exit = t_max[i];
+            enter = (tx0 < tx1 ? tx0 : tx1) > enter ? (tx0 < tx1 ? tx0 : tx1) : enter;
+            exit = (tx0 < tx1 ? tx1 : tx0) < exit ? (tx0 < tx1 ? tx1 : tx0) : exit;
+            enter = (ty0 < ty1 ? ty0 : ty1) > enter ? (ty0 < ty1 ? ty0 : ty1) : enter;
+            exit = (ty0 < ty1 ? ty1 : ty0) < exit ? (ty0 < ty1 ? ty1 : ty0) : exit;
+            enter = (tz0 < tz1 ? tz0 : tz1) > enter ? (tz0 < tz1 ? tz0 : tz1) : enter;
+            exit = (tz0 < tz1 ? tz1 : tz0) < exit ? (tz0 < tz1 ? tz1 : tz0) : exit;
+
+            inside[i] = active[i] & (enter < exit);
+            any |= inside[i];
+        }
+        return any != 0;
+    }
+};
+
+// Closest hits found so far for each ray of a packet
+class packet_hits
+{
+public:
+    double t[ray_packet::max_size];           // Distance to the closest hit so far, ray_t.max for that ray
+    bool hit[ray_packet::max_size];
+    hit_record rec[ray_packet::max_size];
+
+    void reset(int size, double t_max)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            t[i] = t_max;
+            hit[i] = false;
+        }
+    }
+};
+
 class hittable
 {
 public:
@@ -32,6 +161,55 @@ public:
     // Pure virtual function, all derived classes must implement this
     // It checks whether a ray intersects the object and updates "hit_record &rec" with the hit details
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
+
+    // Any-hit query: is there anything at all between ray_t.min and ray_t.max along the ray?
+    // Used for visibility (e.g. shadow rays towards a light) where the closest hit doesn't matter,
+    // so objects can stop at the first hit they find and never build a hit_record.
+    // The default answers with a full closest-hit query.
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
+    // Closest hit query for a whole packet of rays, only the rays with active[i] set are traced.
+    // For every ray that hits the object closer than hits.t[i], hits.t, hits.hit and hits.rec are updated.
+    // Objects without a dedicated packet version simply trace the rays one at a time.
+    virtual void hit_packet(const ray_packet &packet, const unsigned char *active, double t_min,
+                            packet_hits &hits) const
+    {
+        for (int i = 0; i < packet.size; i++)
+        {
+            if (active[i] && hit(packet.get_ray(i), interval(t_min, hits.t[i]), hits.rec[i]))
+            {
+                hits.t[i] = hits.rec[i].t;
+                hits.hit[i] = true;
+            }
+        }
+    }
+
+    // Returns the box enclosing the object, used by acceleration structures (see bvh.h)
+    // to skip whole groups of objects that a ray cannot possibly hit
+    virtual aabb bounding_box() const = 0;
+
+    // Returns the box enclosing the object at a given time in [0, 1].
+    // bounding_box() must enclose the object during the whole time range, which for a moving object
+    // is much bigger than the box at any single moment. Static objects don't need to override this.
+    virtual aabb bounding_box_at(double time) const { return bounding_box(); }
+
+    // Recomputes the bounding box after the geometry has moved and returns the new box.
+    // Objects that can't move keep their box, so by default this is just bounding_box().
+    virtual aabb refit() { return bounding_box(); }
+
+    // Light sampling (see camera.h): objects used as lights can pick a direction towards themselves.
+    // pdf_value is the probability density, per unit solid angle, of random() returning "direction"
+    // from "origin". It must be 0 for directions that miss the object.
+    // "time" is the time of the ray, moving lights are sampled where they are at that time.
+    // Objects that can't be sampled keep the defaults and shouldn't be put in the list of lights.
+    virtual double pdf_value(const point3 &origin, const vec3 &direction, double time) const { return 0.0; }
+
+    // Returns a direction from origin towards a random point of the object (not necessarily a unit vector)
+    virtual vec3 random(const point3 &origin, double time) const { return vec3(1, 0, 0); }
 };
 
 #endif
\ No newline at end of file
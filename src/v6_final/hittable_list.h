@@ -2,7 +2,9 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "sampler.h"
 
+#include <algorithm>
 #include <vector>
 
 // This line defines a C++ class named hittable_list that inherits from hittable.
@@ -22,11 +24,17 @@ public:
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear()
+    {
+        objects.clear();
+        bbox = aabb();
+    }
 
     void add(shared_ptr<hittable> object)
     {
         objects.push_back(object);
+        // Grow the list's bounding box so it always encloses every object added so far
+        bbox = aabb(bbox, object->bounding_box());
     }
 
     // hit(ray(t), interval(tmin, tmax), hit_record)
@@ -55,6 +63,58 @@ public:
 
         return hit_anything;
     }
+
+    // Any object blocking the ray is enough, no need to look at the others
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+        {
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+        return false;
+    }
+
+    void hit_packet(const ray_packet &packet, const unsigned char *active, double t_min,
+                    packet_hits &hits) const override
+    {
+        // hits.t only ever shrinks, so every object just needs to beat the closest hit so far
+        for (const auto &object : objects)
+            object->hit_packet(packet, active, t_min, hits);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb refit() override
+    {
+        bbox = aabb();
+        for (const auto &object : objects)
+            bbox = aabb(bbox, object->refit());
+        return bbox;
+    }
+
+    // A list of lights picks one of its lights at random, so the density of a direction
+    // is the average of the densities of all the lights
+    double pdf_value(const point3 &origin, const vec3 &direction, double time) const override
+    {
+        if (objects.empty())
+            return 0.0;
+
+        auto sum = 0.0;
+        for (const auto &object : objects)
+            sum += object->pdf_value(origin, direction, time);
+        return sum / objects.size();
+    }
+
+    vec3 random(const point3 &origin, double time) const override
+    {
+        auto size = objects.size();
+        auto index = std::min(size - 1, static_cast<size_t>(sample_1d() * size));
+        return objects[index]->random(origin, time);
+    }
+
+private:
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
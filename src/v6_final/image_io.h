@@ -0,0 +1,1075 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "commons.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+    HDR image files
+    The 8-bit PPM written to std::cout is clamped to [0, 1] and gamma corrected, so a brighter or darker
+    version of a render can't be made from it. These formats keep the linear light as floats:
+        PFM        portable float map, a text header and raw 32-bit floats (read and written)
+        OpenEXR    the usual format of renderers and compositing tools, written as uncompressed or RLE
+                   compressed 32-bit float scanlines, with any number of named channels (read and written,
+                   only the uncompressed and RLE compressed flavours)
+        Radiance   .hdr, 8-bit RGBE, the usual format of environment maps (read only)
+        tiles      the tile stream of the renderer (see tile_stream.h, read only here)
+        accumulation  the raw sums of a framebuffer, to add more samples to later (read and written)
+    Images are given as one plane of floats per channel, and read back as colors, top row first.
+*/
+
+// Reads a PFM, OpenEXR, Radiance HDR, tile stream or accumulation file (told apart by their first byte)
+inline bool read_image(const std::string &filename, int &width, int &height, std::vector<color> &image);
+
+// Writes 1 (gray) or 3 (RGB) planes of width * height floats as a PFM file
+inline bool write_pfm(const std::string &filename, int width, int height, const std::vector<const float *> &planes);
+
+struct exr_channel
+{
+    std::string name;   // "R", "G", "B" for the color, "Z" for depth, anything else for extra data
+    const float *plane; // width * height floats, top row first
+};
+
+enum class exr_compression { none = 0, rle = 1 };
+
+// Writes the channels as an OpenEXR file
+inline bool write_exr(const std::string &filename, int width, int height, std::vector<exr_channel> channels,
+                      exr_compression compression = exr_compression::rle);
+
+// Writes the planes of a framebuffer as an accumulation file, and reads them back
+inline bool write_accumulation(const std::string &filename, const framebuffer &frame);
+inline bool read_accumulation(const std::string &filename, framebuffer &frame);
+
+// Writes a PFM or an OpenEXR file depending on the extension of filename (.exr, anything else is PFM).
+// PFM only stores 1 or 3 channels, the first 3 (or first one) are used.
+inline bool write_float_image(const std::string &filename, int width, int height, const std::vector<exr_channel> &channels);
+
+
+// Byte order helpers: PFM uses the byte order of the machine (given by the sign of its scale),
+// OpenEXR is always little endian.
+
+inline bool host_little_endian()
+{
+    std::uint32_t probe = 1;
+    return *reinterpret_cast<unsigned char *>(&probe) == 1;
+}
+
+inline void put_u32(std::vector<unsigned char> &out, std::uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+}
+
+inline void put_u64(std::vector<unsigned char> &out, std::uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+}
+
+inline void put_float(std::vector<unsigned char> &out, float f)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, 4);
+    put_u32(out, bits);
+}
+
+inline void put_string(std::vector<unsigned char> &out, const std::string &s)
+{
+    out.insert(out.end(), s.begin(), s.end());
+    out.push_back(0);
+}
+
+inline std::uint32_t get_u32(const unsigned char *p)
+{
+    return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+}
+
+inline std::uint64_t get_u64(const unsigned char *p)
+{
+    return std::uint64_t(get_u32(p)) | (std::uint64_t(get_u32(p + 4)) << 32);
+}
+
+inline float get_float(const unsigned char *p)
+{
+    auto bits = get_u32(p);
+    float f;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+// 16-bit "half" float to float
+inline float half_to_float(std::uint16_t h)
+{
+    std::uint32_t sign = std::uint32_t(h >> 15) << 31;
+    std::uint32_t exponent = (h >> 10) & 0x1f;
+    std::uint32_t mantissa = h & 0x3ff;
+
+    std::uint32_t bits;
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);    // Infinity and NaN
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;                                    // Zero
+    else
+    {
+        // Denormal: shift the mantissa up until it has its leading 1
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+
+// PFM: "PF" (color) or "Pf" (gray), width and height, then a scale whose sign gives the byte order
+// (negative for little endian). Raw 32-bit floats follow, with the bottom row first.
+// Reads the header, the file is then at the first float. "swap" is set if the byte order isn't the machine's.
+inline bool read_pfm_header(FILE *file, int &w, int &h, int &channels, bool &swap)
+{
+    char type[3] = {0, 0, 0};
+    double scale;
+    if (std::fscanf(file, "%2s %d %d %lf", type, &w, &h, &scale) != 4 || w <= 0 || h <= 0)
+        return false;
+    // Other "P" formats (the PPMs "P3" and "P6") also get this far
+    if (type[0] != 'P' || (type[1] != 'F' && type[1] != 'f'))
+        return false;
+    std::fgetc(file); // The single whitespace before the data
+
+    channels = type[1] == 'F' ? 3 : 1;
+    swap = (scale < 0) != host_little_endian();
+    return true;
+}
+
+// Turns "rows" rows of PFM data (bottom row first) into colors, top row first
+inline void pfm_rows_to_colors(std::vector<float> &data, int w, int rows, int channels, bool swap, color *out)
+{
+    if (swap)
+    {
+        for (auto &value : data)
+        {
+            unsigned char *bytes = reinterpret_cast<unsigned char *>(&value);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+    }
+
+    for (int j = 0; j < rows; j++)
+    {
+        const float *row = &data[size_t(rows - 1 - j) * w * channels];
+        for (int i = 0; i < w; i++)
+        {
+            const float *p = row + i * channels;
+            out[size_t(j) * w + i] = channels == 3 ? color(p[0], p[1], p[2]) : color(p[0], p[0], p[0]);
+        }
+    }
+}
+
+inline bool read_pfm(FILE *file, int &w, int &h, std::vector<color> &image)
+{
+    int channels;
+    bool swap;
+    if (!read_pfm_header(file, w, h, channels, swap))
+        return false;
+
+    std::vector<float> data(size_t(w) * h * channels);
+    if (std::fread(data.data(), sizeof(float), data.size(), file) != data.size())
+        return false;
+
+    image.resize(size_t(w) * h);
+    pfm_rows_to_colors(data, w, h, channels, swap, image.data());
+    return true;
+}
+
+inline bool write_pfm(const std::string &filename, int width, int height, const std::vector<const float *> &planes)
+{
+    FILE *file = std::fopen(filename.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+        return false;
+    }
+
+    int n = planes.size() >= 3 ? 3 : 1;
+    std::fprintf(file, "%s\n%d %d\n%s\n", n == 3 ? "PF" : "Pf", width, height, host_little_endian() ? "-1.0" : "1.0");
+
+    // Bottom row first, channels interleaved
+    std::vector<float> row(size_t(width) * n);
+    for (int j = height - 1; j >= 0; j--)
+    {
+        for (int i = 0; i < width; i++)
+            for (int c = 0; c < n; c++)
+                row[size_t(i) * n + c] = planes[c][size_t(j) * width + i];
+        std::fwrite(row.data(), sizeof(float), row.size(), file);
+    }
+
+    bool ok = !std::ferror(file);
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+    return ok;
+}
+
+
+/*
+    PFM written a rectangle at a time, for images too large to hold in memory (camera_config::tile_output)
+    The header fixes where every row of the image goes in the file, so each rectangle is written at its
+    place as soon as it is done, in any order, and nothing is kept once written. Rows of the file can stay
+    unwritten for a while, the file system fills the gap with zeros.
+*/
+class pfm_tile_writer
+{
+public:
+    ~pfm_tile_writer() { close(); }
+
+    bool open(const std::string &filename, int width, int height)
+    {
+        file = std::fopen(filename.c_str(), "wb");
+        if (!file)
+            return false;
+        image_width = width;
+        image_height = height;
+        data_start = std::fprintf(file, "PF\n%d %d\n%s\n", width, height, host_little_endian() ? "-1.0" : "1.0");
+        return data_start > 0;
+    }
+
+    bool is_open() const { return file != nullptr; }
+
+    // Writes the rectangle of w x h pixels at x, y, given as R, G and B planes (rows from the top).
+    // Can be called from several threads at once.
+    bool write(int x, int y, int w, int h, const std::vector<const float *> &planes)
+    {
+        std::vector<float> rows(size_t(w) * h * 3);
+        for (int j = 0; j < h; j++)
+            for (int i = 0; i < w; i++)
+                for (int c = 0; c < 3; c++)
+                    rows[(size_t(j) * w + i) * 3 + c] = planes[c][size_t(j) * w + i];
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int j = 0; j < h; j++)
+        {
+            // Bottom row first in the file
+            auto row = std::int64_t(image_height - 1 - (y + j));
+            auto offset = data_start + (row * image_width + x) * 3 * std::int64_t(sizeof(float));
+            if (fseeko(file, off_t(offset), SEEK_SET) != 0 ||
+                std::fwrite(&rows[size_t(j) * w * 3], sizeof(float), size_t(w) * 3, file) != size_t(w) * 3)
+                return false;
+        }
+        return true;
+    }
+
+    bool close()
+    {
+        if (!file)
+            return true;
+        bool ok = std::fclose(file) == 0;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    FILE *file = nullptr;
+    int image_width = 0, image_height = 0;
+    std::int64_t data_start = 0;
+    std::mutex mutex;
+};
+
+// Reads a float image a band of rows at a time, like pfm_tile_writer writes one: a PFM is read straight
+// from the file, so an image of any size fits in memory. Other formats are loaded whole with read_image.
+class float_image_reader
+{
+public:
+    ~float_image_reader() { close(); }
+
+    bool open(const std::string &filename)
+    {
+        close();
+        file = std::fopen(filename.c_str(), "rb");
+        if (!file)
+            return false;
+        if (read_pfm_header(file, image_width, image_height, channels, swap))
+        {
+            data_start = ftello(file);
+            return data_start > 0;
+        }
+        close();
+        return read_image(filename, image_width, image_height, whole);
+    }
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    // Reads "count" rows from row y (from the top) into pixels
+    bool read_rows(int y, int count, std::vector<color> &pixels)
+    {
+        pixels.resize(size_t(image_width) * count);
+        if (!file)
+        {
+            if (whole.empty() || y + count > image_height)
+                return false;
+            std::copy(&whole[size_t(y) * image_width], &whole[size_t(y) * image_width] + pixels.size(), pixels.begin());
+            return true;
+        }
+
+        // Bottom row first in the file, the band starts at its last row
+        std::vector<float> data(size_t(image_width) * count * channels);
+        auto row = std::int64_t(image_height - (y + count));
+        auto offset = data_start + row * image_width * channels * std::int64_t(sizeof(float));
+        if (fseeko(file, off_t(offset), SEEK_SET) != 0 || std::fread(data.data(), sizeof(float), data.size(), file) != data.size())
+            return false;
+        pfm_rows_to_colors(data, image_width, count, channels, swap, pixels.data());
+        return true;
+    }
+
+    void close()
+    {
+        if (file)
+            std::fclose(file);
+        file = nullptr;
+        whole.clear();
+    }
+
+private:
+    FILE *file = nullptr;
+    int image_width = 0, image_height = 0;
+    int channels = 3;
+    bool swap = false;
+    std::int64_t data_start = 0;
+    std::vector<color> whole;   // The image, when it is not a PFM
+};
+
+
+// Radiance HDR: text header lines up to an empty line, then "-Y height +X width" and the pixels as
+// RGBE (8-bit mantissas sharing an 8-bit exponent), top row first. Rows are usually run-length encoded
+// one component at a time, which starts with the bytes 2, 2 and the row width.
+inline bool read_hdr_row(FILE *file, int w, std::vector<unsigned char> &rgbe)
+{
+    unsigned char start[4];
+    if (std::fread(start, 1, 4, file) != 4)
+        return false;
+
+    // Flat (not run-length encoded) row
+    if (w < 8 || w > 0x7fff || start[0] != 2 || start[1] != 2 || (start[2] & 0x80))
+    {
+        std::memcpy(rgbe.data(), start, 4);
+        return std::fread(rgbe.data() + 4, 1, size_t(w - 1) * 4, file) == size_t(w - 1) * 4;
+    }
+    if (((start[2] << 8) | start[3]) != w)
+        return false;
+
+    // Each of the 4 components is stored separately as runs (count > 128: repeat the next byte
+    // count - 128 times) and literals (count bytes copied as they are)
+    for (int c = 0; c < 4; c++)
+    {
+        int i = 0;
+        while (i < w)
+        {
+            int count = std::fgetc(file);
+            if (count == EOF || count == 0)
+                return false;
+            if (count > 128)
+            {
+                count -= 128;
+                int value = std::fgetc(file);
+                if (value == EOF || i + count > w)
+                    return false;
+                for (; count > 0; count--)
+                    rgbe[size_t(i++) * 4 + c] = static_cast<unsigned char>(value);
+            }
+            else
+            {
+                if (i + count > w)
+                    return false;
+                for (; count > 0; count--)
+                {
+                    int value = std::fgetc(file);
+                    if (value == EOF)
+                        return false;
+                    rgbe[size_t(i++) * 4 + c] = static_cast<unsigned char>(value);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+inline bool read_hdr(FILE *file, int &w, int &h, std::vector<color> &image)
+{
+    char line[512];
+    while (std::fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n'))
+            break;
+        if (std::strncmp(line, "FORMAT=", 7) == 0 && std::strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+            return false;
+    }
+    if (std::fscanf(file, " -Y %d +X %d", &h, &w) != 2 || w <= 0 || h <= 0)
+        return false;
+    std::fgetc(file);
+
+    image.resize(size_t(w) * h);
+    std::vector<unsigned char> rgbe(size_t(w) * 4);
+    for (int j = 0; j < h; j++)
+    {
+        if (!read_hdr_row(file, w, rgbe))
+            return false;
+        for (int i = 0; i < w; i++)
+        {
+            const unsigned char *p = &rgbe[size_t(i) * 4];
+            double f = p[3] == 0 ? 0 : std::ldexp(1.0, p[3] - (128 + 8));
+            image[size_t(j) * w + i] = color(p[0] * f, p[1] * f, p[2] * f);
+        }
+    }
+    return true;
+}
+
+
+/*
+    OpenEXR RLE compression
+    Floats rarely repeat byte for byte, so the bytes of a scanline are first rearranged to make runs:
+        1. the bytes at even positions are moved to the first half and those at odd positions to the
+           second half, which puts the similar high bytes of neighbouring values next to each other
+        2. every byte is replaced by its difference to the previous one (plus 128), smooth data becomes
+           long runs of almost the same value
+    and then run-length encoded: a count c >= 0 followed by one byte repeated c + 1 times, or a count
+    c < 0 followed by -c bytes copied as they are.
+*/
+inline std::vector<unsigned char> exr_rle_compress(const std::vector<unsigned char> &raw)
+{
+    auto n = raw.size();
+    std::vector<unsigned char> t(n);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; i++)
+        t[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+    for (size_t i = n; i-- > 1;)
+        t[i] = static_cast<unsigned char>(int(t[i]) - int(t[i - 1]) + 128 + 256);
+
+    const size_t min_run = 3, max_run = 127;
+    std::vector<unsigned char> out;
+    size_t run_start = 0;
+    size_t run_end = 1;
+    while (run_start < n)
+    {
+        while (run_end < n && t[run_start] == t[run_end] && run_end - run_start - 1 < max_run)
+            run_end++;
+
+        if (run_end - run_start >= min_run)
+        {
+            out.push_back(static_cast<unsigned char>(run_end - run_start - 1));
+            out.push_back(t[run_start]);
+            run_start = run_end;
+        }
+        else
+        {
+            // Literal bytes, up to the next run of 3 equal bytes
+            while (run_end < n
+                   && (run_end + 1 >= n || t[run_end] != t[run_end + 1] || run_end + 2 >= n || t[run_end + 1] != t[run_end + 2])
+                   && run_end - run_start < max_run)
+                run_end++;
+
+            out.push_back(static_cast<unsigned char>(-static_cast<int>(run_end - run_start)));
+            out.insert(out.end(), t.begin() + run_start, t.begin() + run_end);
+            run_start = run_end;
+        }
+        run_end++;
+    }
+    return out;
+}
+
+inline bool exr_rle_decompress(const unsigned char *in, size_t in_size, std::vector<unsigned char> &raw)
+{
+    auto n = raw.size();
+    std::vector<unsigned char> t;
+    t.reserve(n);
+    const unsigned char *end = in + in_size;
+    while (in < end)
+    {
+        int count = static_cast<signed char>(*in++);
+        if (count < 0)
+        {
+            if (end - in < -count || t.size() + size_t(-count) > n)
+                return false;
+            t.insert(t.end(), in, in - count);
+            in -= count;
+        }
+        else
+        {
+            if (in == end || t.size() + size_t(count) + 1 > n)
+                return false;
+            t.insert(t.end(), size_t(count) + 1, *in++);
+        }
+    }
+    if (t.size() != n)
+        return false;
+
+    for (size_t i = 1; i < n; i++)
+        t[i] = static_cast<unsigned char>(int(t[i - 1]) + int(t[i]) - 128);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; i++)
+        raw[i] = t[(i & 1) ? half + i / 2 : i / 2];
+    return true;
+}
+
+/*
+    OpenEXR (single part, scanlines)
+        magic number and version
+        header: attributes as (name, type, size, value), ended by an empty name
+        offset table: file position of every chunk
+        chunks: one per scanline, the y of the line, the size of its data and the data, where every
+                channel (in alphabetical order of the names) stores the whole line of its values
+    A line that doesn't get smaller with RLE is stored uncompressed, readers tell by its size.
+*/
+inline bool write_exr(const std::string &filename, int width, int height, std::vector<exr_channel> channels,
+                      exr_compression compression)
+{
+    std::sort(channels.begin(), channels.end(),
+              [](const exr_channel &a, const exr_channel &b) { return a.name < b.name; });
+
+    std::vector<unsigned char> out;
+    put_u32(out, 20000630);     // Magic number
+    put_u32(out, 2);            // Version 2, single part scanline file
+
+    auto attribute = [&](const char *name, const char *type, std::uint32_t size) {
+        put_string(out, name);
+        put_string(out, type);
+        put_u32(out, size);
+    };
+
+    std::uint32_t list_size = 1;
+    for (const auto &c : channels)
+        list_size += std::uint32_t(c.name.size()) + 1 + 16;
+    attribute("channels", "chlist", list_size);
+    for (const auto &c : channels)
+    {
+        put_string(out, c.name);
+        put_u32(out, 2);        // 32-bit float
+        put_u32(out, 0);        // Not perceptually linear, 3 reserved bytes
+        put_u32(out, 1);        // No subsampling in x and y
+        put_u32(out, 1);
+    }
+    out.push_back(0);
+
+    attribute("compression", "compression", 1);
+    out.push_back(static_cast<unsigned char>(compression));
+    for (const char *window : {"dataWindow", "displayWindow"})
+    {
+        attribute(window, "box2i", 16);
+        put_u32(out, 0);
+        put_u32(out, 0);
+        put_u32(out, std::uint32_t(width - 1));
+        put_u32(out, std::uint32_t(height - 1));
+    }
+    attribute("lineOrder", "lineOrder", 1);
+    out.push_back(0);           // Increasing y
+    attribute("pixelAspectRatio", "float", 4);
+    put_float(out, 1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    put_float(out, 0.0f);
+    put_float(out, 0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    put_float(out, 1.0f);
+    out.push_back(0);           // End of the header
+
+    auto offsets = out.size();
+    out.resize(out.size() + 8 * size_t(height));
+
+    std::vector<unsigned char> line;
+    for (int j = 0; j < height; j++)
+    {
+        line.clear();
+        for (const auto &c : channels)
+            for (int i = 0; i < width; i++)
+                put_float(line, c.plane[size_t(j) * width + i]);
+
+        if (compression == exr_compression::rle)
+        {
+            auto packed = exr_rle_compress(line);
+            if (packed.size() < line.size())
+                line.swap(packed);
+        }
+
+        std::vector<unsigned char> position;
+        put_u64(position, out.size());
+        std::copy(position.begin(), position.end(), out.begin() + offsets + 8 * size_t(j));
+
+        put_u32(out, std::uint32_t(j));
+        put_u32(out, std::uint32_t(line.size()));
+        out.insert(out.end(), line.begin(), line.end());
+    }
+
+    FILE *file = std::fopen(filename.c_str(), "wb");
+    bool ok = file && std::fwrite(out.data(), 1, out.size(), file) == out.size();
+    if (file)
+        ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+    return ok;
+}
+
+// Reads the R, G and B channels (or Y for a gray image) of a scanline OpenEXR file. Only uncompressed
+// and RLE compressed files are supported, which includes everything written by write_exr.
+inline bool read_exr(FILE *file, int &w, int &h, std::vector<color> &image)
+{
+    std::vector<unsigned char> data;
+    unsigned char buffer[65536];
+    size_t got;
+    while ((got = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + got);
+
+    if (data.size() < 8 || get_u32(&data[0]) != 20000630 || (data[4] != 2) || (data[5] & 0x1a))
+        return false;   // Not a single part scanline file
+
+    struct channel_info { std::string name; std::uint32_t type; };
+    std::vector<channel_info> channels;
+    int compression = -1;
+    int x_min = 0, y_min = 0, x_max = -1, y_max = -1;
+
+    // Header
+    size_t pos = 8;
+    auto read_string = [&](std::string &s) {
+        auto end = std::find(data.begin() + pos, data.end(), 0);
+        if (end == data.end())
+            return false;
+        s.assign(data.begin() + pos, end);
+        pos = end - data.begin() + 1;
+        return true;
+    };
+    for (;;)
+    {
+        std::string name, type;
+        if (!read_string(name))
+            return false;
+        if (name.empty())
+            break;
+        if (!read_string(type) || pos + 4 > data.size())
+            return false;
+        auto size = get_u32(&data[pos]);
+        pos += 4;
+        if (pos + size > data.size())
+            return false;
+
+        if (name == "channels")
+        {
+            auto end = pos + size;
+            std::string channel;
+            while (read_string(channel) && !channel.empty() && pos + 16 <= end)
+            {
+                channels.push_back({channel, get_u32(&data[pos])});
+                pos += 16;
+            }
+            pos = end;
+            continue;
+        }
+        if (name == "compression")
+            compression = data[pos];
+        else if (name == "dataWindow")
+        {
+            x_min = int(get_u32(&data[pos]));
+            y_min = int(get_u32(&data[pos + 4]));
+            x_max = int(get_u32(&data[pos + 8]));
+            y_max = int(get_u32(&data[pos + 12]));
+        }
+        pos += size;
+    }
+
+    w = x_max - x_min + 1;
+    h = y_max - y_min + 1;
+    if (w <= 0 || h <= 0 || channels.empty() || (compression != 0 && compression != 1))
+        return false;
+
+    // Where every channel starts in a line, and which channel goes to which color component
+    size_t line_size = 0;
+    std::vector<size_t> channel_start;
+    int component[3] = {-1, -1, -1};
+    for (size_t c = 0; c < channels.size(); c++)
+    {
+        const auto &name = channels[c].name;
+        if (name == "R" || name == "Y")
+            component[0] = int(c);
+        if (name == "G" || name == "Y")
+            component[1] = int(c);
+        if (name == "B" || name == "Y")
+            component[2] = int(c);
+        channel_start.push_back(line_size);
+        line_size += size_t(w) * (channels[c].type == 1 ? 2 : 4);
+    }
+
+    image.assign(size_t(w) * h, color(0, 0, 0));
+    std::vector<unsigned char> line(line_size);
+    if (pos + 8 * size_t(h) > data.size())
+        return false;
+    for (int chunk = 0; chunk < h; chunk++)
+    {
+        auto offset = get_u64(&data[pos + 8 * size_t(chunk)]);
+        if (offset + 8 > data.size())
+            return false;
+        int j = int(get_u32(&data[offset])) - y_min;
+        auto size = get_u32(&data[offset + 4]);
+        const unsigned char *chunk_data = &data[offset + 8];
+        if (j < 0 || j >= h || offset + 8 + size > data.size())
+            return false;
+
+        if (size == line_size)
+            std::copy(chunk_data, chunk_data + size, line.begin());
+        else if (compression != 1 || !exr_rle_decompress(chunk_data, size, line))
+            return false;
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (component[k] < 0)
+                continue;
+            const unsigned char *values = &line[channel_start[component[k]]];
+            auto type = channels[component[k]].type;
+            for (int i = 0; i < w; i++)
+            {
+                double v;
+                if (type == 1)
+                    v = half_to_float(std::uint16_t(values[2 * i] | (values[2 * i + 1] << 8)));
+                else if (type == 2)
+                    v = get_float(values + 4 * i);
+                else
+                    v = get_u32(values + 4 * i);
+                image[size_t(j) * w + i][k] = v;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Tile stream (see tile_stream.h): the tiles are pasted into the image as they come, pixels that no tile
+// covered stay black. It is read front to back, so the file can be a pipe.
+const char tile_stream_magic[9] = "RTTILES1";
+
+inline bool read_tile_stream(FILE *file, int &w, int &h, std::vector<color> &image)
+{
+    unsigned char header[20];
+    if (std::fread(header, 1, 20, file) != 20 || std::memcmp(header, tile_stream_magic, 8) != 0)
+        return false;
+    w = int(get_u32(header + 8));
+    h = int(get_u32(header + 12));
+    if (w <= 0 || h <= 0 || get_u32(header + 16) != 3)
+        return false;
+    image.assign(size_t(w) * h, color(0, 0, 0));
+
+    std::vector<unsigned char> pixels;
+    for (;;)
+    {
+        unsigned char tile[24];
+        if (std::fread(tile, 1, 4, file) != 4)
+            return false;
+        if (std::memcmp(tile, "DONE", 4) == 0)
+            return true;
+        if (std::memcmp(tile, "TILE", 4) != 0 || std::fread(tile + 4, 1, 20, file) != 20)
+            return false;
+
+        auto x = get_u32(tile + 4), y = get_u32(tile + 8), tw = get_u32(tile + 12), th = get_u32(tile + 16);
+        if (x + tw > std::uint32_t(w) || y + th > std::uint32_t(h))
+            return false;
+        pixels.resize(size_t(tw) * th * 12);
+        if (std::fread(pixels.data(), 1, pixels.size(), file) != pixels.size())
+            return false;
+
+        const unsigned char *p = pixels.data();
+        for (auto j = y; j < y + th; j++)
+            for (auto i = x; i < x + tw; i++, p += 12)
+                image[size_t(j) * w + i] = color(get_float(p), get_float(p + 4), get_float(p + 8));
+    }
+}
+
+/*
+    Accumulation file: a framebuffer as it is while rendering, sums of samples rather than averages, so
+    renders of more samples of the same image can be added to it (see camera_config::first_sample and
+    merge.cpp). Little endian:
+        "ACCUMUL1", width, height, then a 32-bit mask with bit p set for every pass p of the framebuffer
+        then every channel of every pass in the order of the pass enum, width * height 32-bit floats each
+*/
+const char accumulation_magic[9] = "ACCUMUL1";
+const int accumulation_header_size = 20;
+
+// The header of a framebuffer of w x h pixels with the passes of "mask"
+inline std::vector<unsigned char> accumulation_header(int w, int h, std::uint32_t mask)
+{
+    std::vector<unsigned char> header(accumulation_magic, accumulation_magic + 8);
+    put_u32(header, std::uint32_t(w));
+    put_u32(header, std::uint32_t(h));
+    put_u32(header, mask);
+    return header;
+}
+
+// Checks a header and gets its size and the extra passes (besides beauty and sample_count)
+inline bool parse_accumulation_header(const unsigned char *header, int &w, int &h, std::vector<pass> &extra)
+{
+    if (std::memcmp(header, accumulation_magic, 8) != 0)
+        return false;
+    w = int(get_u32(header + 8));
+    h = int(get_u32(header + 12));
+    auto mask = get_u32(header + 16);
+    if (w <= 0 || h <= 0 || (mask & 3) != 3 || mask >> pass_count)
+        return false;
+
+    extra.clear();
+    for (int p = int(pass::sample_count) + 1; p < pass_count; p++)
+        if (mask & (1u << p))
+            extra.push_back(pass(p));
+    return true;
+}
+
+inline bool read_accumulation(FILE *file, framebuffer &frame)
+{
+    unsigned char header[accumulation_header_size];
+    int w, h;
+    std::vector<pass> extra;
+    if (std::fread(header, 1, sizeof(header), file) != sizeof(header) || !parse_accumulation_header(header, w, h, extra))
+        return false;
+    frame.reset(w, h, extra);
+
+    std::vector<unsigned char> bytes(frame.pixel_count() * 4);
+    for (int p = 0; p < pass_count; p++)
+        for (int c = 0; frame.has(pass(p)) && c < framebuffer::channels(pass(p)); c++)
+        {
+            if (std::fread(bytes.data(), 1, bytes.size(), file) != bytes.size())
+                return false;
+            float *plane = frame.plane(pass(p), c);
+            for (size_t i = 0; i < frame.pixel_count(); i++)
+                plane[i] = get_float(&bytes[4 * i]);
+        }
+    return true;
+}
+
+inline bool read_accumulation(const std::string &filename, framebuffer &frame)
+{
+    FILE *file = std::fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+    bool loaded = read_accumulation(file, frame);
+    std::fclose(file);
+    return loaded;
+}
+
+inline bool write_accumulation(const std::string &filename, const framebuffer &frame)
+{
+    std::uint32_t mask = 0;
+    for (int p = 0; p < pass_count; p++)
+        if (frame.has(pass(p)))
+            mask |= 1u << p;
+    auto header = accumulation_header(frame.width(), frame.height(), mask);
+
+    FILE *file = std::fopen(filename.c_str(), "wb");
+    bool ok = file && std::fwrite(header.data(), 1, header.size(), file) == header.size();
+    std::vector<unsigned char> bytes;
+    for (int p = 0; ok && p < pass_count; p++)
+        for (int c = 0; ok && frame.has(pass(p)) && c < framebuffer::channels(pass(p)); c++)
+        {
+            bytes.clear();
+            const float *plane = frame.plane(pass(p), c);
+            for (size_t i = 0; i < frame.pixel_count(); i++)
+                put_float(bytes, plane[i]);
+            ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+        }
+    if (file)
+        ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+    return ok;
+}
+
+// An accumulation file read and written a tile at a time, for images too large for memory (tile_output).
+// In every plane the rows of a tile are runs of floats, which are read and written with pread and pwrite:
+// they don't move a shared file offset, so the threads and the worker processes (which inherit the
+// descriptor across fork) can all read tiles from the same file.
+class accumulation_tile_file
+{
+public:
+    ~accumulation_tile_file() { close(); }
+
+    // Opens an existing file to read tiles from
+    bool open(const std::string &filename)
+    {
+        close();
+        fd = ::open(filename.c_str(), O_RDONLY);
+        unsigned char header[accumulation_header_size];
+        if (fd < 0 || ::pread(fd, header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+            !parse_accumulation_header(header, w, h, extra))
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // Creates a file of width x height pixels with the extra passes besides beauty and sample_count, all zero
+    bool create(const std::string &filename, int width, int height, const std::vector<pass> &extra_passes)
+    {
+        close();
+        w = width;
+        h = height;
+        extra = extra_passes;
+        std::uint32_t mask = 3;
+        for (auto p : extra)
+            mask |= 1u << int(p);
+        auto header = accumulation_header(w, h, mask);
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ::pwrite(fd, header.data(), header.size(), 0) != ssize_t(header.size()) ||
+            ::ftruncate(fd, off_t(plane_offset(plane_count()))) != 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    int width() const { return w; }
+    int height() const { return h; }
+
+    // Reads the rectangle at x, y of the size of tile into the passes of tile. Passes missing from
+    // either side are skipped, like framebuffer::accumulate into an empty framebuffer.
+    bool read_tile(framebuffer &tile, int x, int y) const
+    {
+        std::vector<unsigned char> bytes(size_t(tile.width()) * 4);
+        return each_row(tile, x, y, [&](float *row, std::int64_t offset) {
+            if (::pread(fd, bytes.data(), bytes.size(), off_t(offset)) != ssize_t(bytes.size()))
+                return false;
+            for (int i = 0; i < tile.width(); i++)
+                row[i] = get_float(&bytes[4 * size_t(i)]);
+            return true;
+        });
+    }
+
+    // Writes the passes of tile (those the file has) to the rectangle at x, y
+    bool write_tile(const framebuffer &tile, int x, int y)
+    {
+        std::vector<unsigned char> bytes;
+        return each_row(tile, x, y, [&](const float *row, std::int64_t offset) {
+            bytes.clear();
+            for (int i = 0; i < tile.width(); i++)
+                put_float(bytes, row[i]);
+            return ::pwrite(fd, bytes.data(), bytes.size(), off_t(offset)) == ssize_t(bytes.size());
+        });
+    }
+
+    bool close()
+    {
+        bool ok = fd < 0 || ::close(fd) == 0;
+        fd = -1;
+        return ok;
+    }
+
+private:
+    int fd = -1;
+    int w = 0, h = 0;
+    std::vector<pass> extra;
+
+    bool has(pass p) const
+    {
+        return p == pass::beauty || p == pass::sample_count || std::find(extra.begin(), extra.end(), p) != extra.end();
+    }
+
+    int plane_count() const
+    {
+        int planes = 0;
+        for (int p = 0; p < pass_count; p++)
+            if (has(pass(p)))
+                planes += framebuffer::channels(pass(p));
+        return planes;
+    }
+
+    std::int64_t plane_offset(int plane) const
+    {
+        return accumulation_header_size + std::int64_t(plane) * w * h * 4;
+    }
+
+    // Calls visit(row, offset) for every row of every channel of the passes of tile the file has,
+    // with the offset of that row of the rectangle at x, y in the file
+    template <typename Frame, typename Visit>
+    bool each_row(Frame &tile, int x, int y, Visit visit) const
+    {
+        int plane = 0;
+        for (int p = 0; p < pass_count; p++)
+        {
+            if (!has(pass(p)))
+                continue;
+            for (int c = 0; c < framebuffer::channels(pass(p)); c++, plane++)
+                for (int j = 0; tile.has(pass(p)) && j < tile.height(); j++)
+                {
+                    auto offset = plane_offset(plane) + (std::int64_t(y + j) * w + x) * 4;
+                    if (!visit(tile.plane(pass(p), c) + size_t(j) * tile.width(), offset))
+                        return false;
+                }
+        }
+        return true;
+    }
+};
+
+inline bool read_image(const std::string &filename, int &width, int &height, std::vector<color> &image)
+{
+    FILE *file = std::fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    // One byte tells the formats apart, and can be put back even when the file is a pipe
+    bool loaded = false;
+    int magic = std::getc(file);
+    if (magic != EOF && std::ungetc(magic, file) != EOF)
+    {
+        if (magic == 'P')
+            loaded = read_pfm(file, width, height, image);
+        else if (magic == '#')
+            loaded = read_hdr(file, width, height, image);
+        else if (magic == 0x76)
+            loaded = read_exr(file, width, height, image);
+        else if (magic == 'R')
+            loaded = read_tile_stream(file, width, height, image);
+        else if (magic == 'A')
+        {
+            // The average of the samples
+            framebuffer frame;
+            loaded = read_accumulation(file, frame);
+            if (loaded)
+            {
+                width = frame.width();
+                height = frame.height();
+                image.resize(frame.pixel_count());
+                for (size_t pixel = 0; pixel < frame.pixel_count(); pixel++)
+                    image[pixel] = frame.value(pass::beauty, pixel);
+            }
+        }
+    }
+    std::fclose(file);
+    return loaded;
+}
+
+inline bool write_float_image(const std::string &filename, int width, int height, const std::vector<exr_channel> &channels)
+{
+    auto dot = filename.rfind('.');
+    if (dot != std::string::npos && filename.substr(dot) == ".exr")
+        return write_exr(filename, width, height, channels);
+
+    std::vector<const float *> planes;
+    for (size_t c = 0; c < channels.size() && c < 3; c++)
+        planes.push_back(channels[c].plane);
+    if (planes.size() == 2)
+        planes.pop_back();
+    return write_pfm(filename, width, height, planes);
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+
+/*
+    Two-level instancing
+    Instead of copying the geometry of an object every time we want it in the scene,
+    the geometry is built once (the "bottom level", usually a bvh_node over the object's parts)
+    and every copy is just an "instance": a pointer to that shared geometry plus a transform.
+
+        auto cluster = make_shared<bvh_node>(cluster_parts);                 // Bottom level (BLAS)
+        forest.add(make_shared<instance>(cluster, transform::translate(p))); // Many cheap copies
+        world.add(make_shared<bvh_node>(forest));                            // Top level (TLAS)
+
+    A bvh_node built over instances is the top-level acceleration structure: its leaves are
+    instances, and each instance continues the traversal inside the shared bottom-level tree.
+    Memory grows with the number of unique objects, each extra copy only costs one instance.
+*/
+class instance : public hittable
+{
+public:
+    instance(shared_ptr<hittable> object, const transform &object_to_world)
+        : object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse())
+    {
+        update_bounding_box();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        // Instead of moving the object into the world, move the ray into the object's space.
+        // The direction is not normalized, so a distance "t" along the object space ray
+        // is the same point as "t" along the world space ray and ray_t needs no conversion.
+        ray object_ray(world_to_object.apply_point(r.origin()), world_to_object.apply_vector(r.direction()), r.time());
+
+        if (!object->hit(object_ray, ray_t, rec))
+            return false;
+
+        // Move the intersection point and the normal back to world space.
+        // front_face is kept as is: the transform preserves dot(direction, normal)
+        // so the normal still points against the ray.
+        rec.p = object_to_world.apply_point(rec.p);
+        rec.normal = unit_vector(world_to_object.apply_transpose(rec.normal));
+
+        return true;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        ray object_ray(world_to_object.apply_point(r.origin()), world_to_object.apply_vector(r.direction()), r.time());
+        return object->occluded(object_ray, ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override
+    {
+        return transformed_box(object->bounding_box_at(time));
+    }
+
+    // The shared object is NOT refit here: many instances point to the same object, refitting it
+    // from every instance would repeat the work (and race when refitting in parallel).
+    // Refit the shared object once, then refit the instances.
+    aabb refit() override
+    {
+        update_bounding_box();
+        return bbox;
+    }
+
+private:
+    shared_ptr<hittable> object;
+    transform object_to_world;
+    transform world_to_object;
+    aabb bbox;
+
+    void update_bounding_box()
+    {
+        bbox = transformed_box(object->bounding_box());
+    }
+
+    // The world space box is the box around the 8 transformed corners of the object space box
+    aabb transformed_box(const aabb &box) const
+    {
+        aabb result = aabb::empty;
+        for (int i = 0; i < 2; i++)
+        {
+            for (int j = 0; j < 2; j++)
+            {
+                for (int k = 0; k < 2; k++)
+                {
+                    auto corner = point3(i ? box.x.max : box.x.min,
+                                         j ? box.y.max : box.y.min,
+                                         k ? box.z.max : box.z.min);
+                    auto p = object_to_world.apply_point(corner);
+                    result = aabb(result, aabb(p, p));
+                }
+            }
+        }
+        return result;
+    }
+};
+
+#endif
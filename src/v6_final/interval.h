@@ -12,6 +12,13 @@ public:
 
     interval(double min, double max) : min(min), max(max) {}
 
+    // Creates the tightest interval enclosing both input intervals
+    interval(const interval &a, const interval &b)
+    {
+        min = a.min <= b.min ? a.min : b.min;
+        max = a.max >= b.max ? a.max : b.max;
+    }
+
     double size() const
     {
         return max - min;
@@ -37,6 +44,13 @@ public:
         return x;
     }
 
+    // Pads the interval by delta (delta / 2 on each side)
+    interval expand(double delta) const
+    {
+        auto padding = delta / 2;
+        return interval(min - padding, max + padding);
+    }
+
     static const interval empty, universe;
 };
 
@@ -1,18 +1,22 @@
 #include "commons.h"
+#include "bvh.h"
 #include "camera.h"
 #include "interval.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "obj_loader.h"
+#include "plane.h"
 #include "sphere.h"
 
 #include <iostream>
+#include <vector>
 
-int main()
-{   
+void final_scene()
+{
     hittable_list world;
 
     auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -51,19 +55,397 @@ int main()
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
+    // The ground plane is infinite, so it is kept out of the BVH
+    world = hittable_list(make_shared<bvh_node>(world));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
 
     camera_config config = {
         16.0 / 9.0,         // Aspect ratio
         1200,               // Image width
-        500,                // Samples per pixel
+        100,                // Samples per pixel
+        50,                 // Max depth
+        20,                 // Vertical field of view
+        point3(13,2,3),     // Look from
+        point3(0, 0, 0),    // Look at
+        vec3(0, 1, 0),      // Vertical up vector from camera
+        0.6,                // Defocus angle
+        10,                 // Focus distance
+        0,                  // Shutter open
+        0,                  // Shutter close
+        8                   // Packet size (0 = trace camera rays one at a time)
+    };
+    camera cam(config);
+    cam.render(world);
+}
+
+// Builds one tree: a trunk of stacked spheres with a canopy of spheres on top.
+// The tree is built once and then shared by every instance of it in the forest.
+shared_ptr<hittable> make_tree(shared_ptr<material> bark, shared_ptr<material> leaves)
+{
+    hittable_list parts;
+
+    for (int i = 0; i < 4; i++)
+        parts.add(make_shared<sphere>(point3(0, 0.15 + 0.25 * i, 0), 0.15, bark));
+
+    for (int i = 0; i < 16; i++)
+    {
+        auto offset = random_double(0, 0.45) * random_unit_vector();
+        parts.add(make_shared<sphere>(point3(0, 1.3, 0) + offset, random_double(0.2, 0.35), leaves));
+    }
+
+    // Bottom-level acceleration structure of the tree
+    return make_shared<bvh_node>(parts);
+}
+
+void instanced_forest()
+{
+    hittable_list world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
+
+    auto bark = make_shared<lambertian>(color(0.35, 0.2, 0.1));
+    shared_ptr<hittable> trees[] = {
+        make_tree(bark, make_shared<lambertian>(color(0.1, 0.45, 0.1))),
+        make_tree(bark, make_shared<lambertian>(color(0.3, 0.5, 0.05))),
+        make_tree(bark, make_shared<metal>(color(0.8, 0.6, 0.2), 0.3)),
+    };
+
+    // 900 trees, but only 3 * 20 spheres are actually stored in memory
+    hittable_list forest;
+    for (int a = -15; a < 15; a++) {
+        for (int b = -15; b < 15; b++) {
+            auto position = point3(a + 0.6*random_double(), 0, b + 0.6*random_double());
+            auto object_to_world = transform::translate(position)
+                                 * transform::rotate(vec3(0, 1, 0), random_double(0, 360))
+                                 * transform::scale(random_double(0.3, 0.5));
+            forest.add(make_shared<instance>(trees[int(random_double(0, 3))], object_to_world));
+        }
+    }
+
+    // Top-level acceleration structure over the instances
+    world.add(make_shared<bvh_node>(forest));
+
+    camera_config config = {
+        16.0 / 9.0,         // Aspect ratio
+        400,                // Image width
+        100,                // Samples per pixel
+        50,                 // Max depth
+        30,                 // Vertical field of view
+        point3(0, 6, 18),   // Look from
+        point3(0, 0, 0),    // Look at
+        vec3(0, 1, 0),      // Vertical up vector from camera
+        0,                  // Defocus angle
+        18,                 // Focus distance
+        0,                  // Shutter open
+        0,                  // Shutter close
+        0                   // Packet size (0 = trace camera rays one at a time)
+    };
+    camera cam(config);
+    cam.render(world);
+}
+
+// Renders a short animation of bouncing, drifting spheres.
+// Every frame is written as its own PPM image, one after the other, to the same output.
+// (Split them with e.g. "ffmpeg -f image2pipe -i v6.ppm frame%03d.png")
+void bouncing_animation()
+{
+    hittable_list world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
+
+    hittable_list balls;
+    std::vector<shared_ptr<sphere>> spheres;
+    std::vector<point3> start;
+    std::vector<vec3> drift;
+    for (int a = -8; a < 8; a++) {
+        for (int b = -8; b < 8; b++) {
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            auto albedo = color::random() * color::random();
+            auto ball = make_shared<sphere>(center, 0.2, make_shared<lambertian>(albedo));
+            spheres.push_back(ball);
+            start.push_back(center);
+            drift.push_back(vec3(random_double(-0.1, 0.1), 0, random_double(-0.1, 0.1)));
+            balls.add(ball);
+        }
+    }
+
+    auto moving = make_shared<dynamic_bvh>(balls);
+    world.add(moving);
+
+    camera_config config = {
+        16.0 / 9.0,         // Aspect ratio
+        400,                // Image width
+        50,                 // Samples per pixel
+        50,                 // Max depth
+        30,                 // Vertical field of view
+        point3(0, 4, 16),   // Look from
+        point3(0, 0, 0),    // Look at
+        vec3(0, 1, 0),      // Vertical up vector from camera
+        0,                  // Defocus angle
+        16,                 // Focus distance
+        0,                  // Shutter open
+        0,                  // Shutter close
+        0                   // Packet size (0 = trace camera rays one at a time)
+    };
+    camera cam(config);
+
+    for (int frame = 0; frame < 24; frame++) {
+        // Only the sphere centers change between frames
+        for (size_t i = 0; i < spheres.size(); i++) {
+            auto height = 1.5 * std::fabs(std::sin(0.3 * frame + i));
+            spheres[i]->set_center(start[i] + frame * drift[i] + vec3(0, height, 0));
+        }
+
+        // Refit the BVH, it is only rebuilt when its quality got too low
+        if (moving->update())
+            std::clog << "\rFrame " << frame << ": BVH rebuilt\n";
+
+        cam.render(world);
+    }
+}
+
+// The final scene with the small diffuse spheres bouncing up while the shutter is open
+void motion_blur()
+{
+    hittable_list world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                if (choose_mat < 0.8) {
+                    // moving diffuse
+                    auto albedo = color::random() * color::random();
+                    auto center2 = center + vec3(0, random_double(0, 0.5), 0);
+                    world.add(make_shared<sphere>(center, center2, 0.2, make_shared<lambertian>(albedo)));
+                } else {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    world.add(make_shared<sphere>(center, 0.2, make_shared<metal>(albedo, fuzz)));
+                }
+            }
+        }
+    }
+
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    // The ground plane is infinite, so it is kept out of the BVH
+    world = hittable_list(make_shared<bvh_node>(world));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
+
+    camera_config config = {
+        16.0 / 9.0,         // Aspect ratio
+        400,                // Image width
+        100,                // Samples per pixel
         50,                 // Max depth
         20,                 // Vertical field of view
         point3(13,2,3),     // Look from
         point3(0, 0, 0),    // Look at
         vec3(0, 1, 0),      // Vertical up vector from camera
         0.6,                // Defocus angle
-        10                  // Focus distance
+        10,                 // Focus distance
+        0,                  // Shutter open
+        1,                  // Shutter close
+        0                   // Packet size (0 = trace camera rays one at a time)
+    };
+    camera cam(config);
+    cam.render(world);
+}
+
+// Builds a torus as an indexed triangle mesh: "rings" x "sides" vertices, 2 triangles per quad.
+shared_ptr<mesh_data> make_torus(double major_radius, double minor_radius, int rings, int sides)
+{
+    auto data = make_shared<mesh_data>();
+    for (int i = 0; i < rings; i++) {
+        auto phi = 2 * pi * i / rings;
+        vec3 ring_direction(std::cos(phi), 0, std::sin(phi));
+        for (int j = 0; j < sides; j++) {
+            auto theta = 2 * pi * j / sides;
+            vec3 normal = std::cos(theta) * ring_direction + vec3(0, std::sin(theta), 0);
+            data->vertices.push_back(major_radius * ring_direction + minor_radius * normal);
+            data->normals.push_back(normal);
+        }
+    }
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < sides; j++) {
+            std::uint32_t a = i * sides + j;
+            std::uint32_t b = ((i + 1) % rings) * sides + j;
+            std::uint32_t c = ((i + 1) % rings) * sides + (j + 1) % sides;
+            std::uint32_t d = i * sides + (j + 1) % sides;
+            std::uint32_t quad[6] = {a, b, c, a, c, d};
+            data->indices.insert(data->indices.end(), quad, quad + 6);
+        }
+    }
+    return data;
+}
+
+void triangle_meshes()
+{
+    hittable_list world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
+
+    // 2 tori sharing the same 80000 triangles of mesh data
+    auto torus = make_torus(1.0, 0.35, 400, 100);
+    auto gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.05);
+    auto clay = make_shared<lambertian>(color(0.7, 0.3, 0.2));
+    world.add(make_shared<instance>(make_shared<triangle_mesh>(torus, gold), transform::translate(vec3(-1.2, 0.35, 0))));
+    world.add(make_shared<instance>(make_shared<triangle_mesh>(torus, clay),
+                                    transform::translate(vec3(1.2, 1.0, 0)) * transform::rotate(vec3(1, 0, 0), 70)));
+
+    // Meshes from OBJ files are added the same way, e.g.:
+    //     world.add(load_obj("bunny.obj", make_shared<lambertian>(color(0.8, 0.8, 0.8))));
+
+    camera_config config = {
+        16.0 / 9.0,         // Aspect ratio
+        400,                // Image width
+        100,                // Samples per pixel
+        50,                 // Max depth
+        30,                 // Vertical field of view
+        point3(0, 3, 8),    // Look from
+        point3(0, 0.6, 0),  // Look at
+        vec3(0, 1, 0),      // Vertical up vector from camera
+        0,                  // Defocus angle
+        8,                  // Focus distance
+        0,                  // Shutter open
+        0,                  // Shutter close
+        0                   // Packet size (0 = trace camera rays one at a time)
     };
     camera cam(config);
     cam.render(world);
 }
+
+// Cornell box lit by a small ceiling light and a glowing sphere, there is no sky.
+// The lights are added to the world and also to a separate list given to the camera,
+// so the diffuse walls send shadow rays straight to them.
+void cornell_box()
+{
+    hittable_list world;
+    hittable_list lights;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+    auto glow  = make_shared<diffuse_light>(color(8, 6, 3));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    world.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(370, 120, 370), 120, white));
+
+    auto ceiling_light = make_shared<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), light);
+    auto sphere_light = make_shared<sphere>(point3(420, 40, 120), 40, glow);
+    world.add(ceiling_light);
+    world.add(sphere_light);
+    lights.add(ceiling_light);
+    lights.add(sphere_light);
+
+    world = hittable_list(make_shared<bvh_node>(world));
+
+    camera_config config = {
+        1.0,                    // Aspect ratio
+        600,                    // Image width
+        64,                     // Samples per pixel
+        50,                     // Max depth
+        40,                     // Vertical field of view
+        point3(278, 278, -800), // Look from
+        point3(278, 278, 0),    // Look at
+        vec3(0, 1, 0),          // Vertical up vector from camera
+        0,                      // Defocus angle
+        10,                     // Focus distance
+        0,                      // Shutter open
+        0,                      // Shutter close
+        0                       // Packet size (0 = trace camera rays one at a time)
+    };
+    config.black_background = true;
+    config.sampling = sampling_pattern::sobol;
+    camera cam(config);
+    cam.render(world, lights);
+}
+
+// A stand-in for an HDR photo of the sky: a blue gradient and a small, very bright sun
+shared_ptr<environment_map> make_sun_sky(const vec3 &sun_direction, int width, int height)
+{
+    auto sun = unit_vector(sun_direction);
+    auto sun_cos_radius = std::cos(degrees_to_radians(1.5));
+    std::vector<color> pixels;
+    for (int j = 0; j < height; j++) {
+        auto theta = pi * (j + 0.5) / height;
+        for (int i = 0; i < width; i++) {
+            auto phi = 2 * pi * (i + 0.5) / width - pi;
+            vec3 direction(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            auto a = std::fmax(0.0, direction.y());
+            color sky = (1 - a) * color(0.8, 0.85, 0.9) + a * color(0.2, 0.4, 0.9);
+            if (dot(direction, sun) > sun_cos_radius)
+                sky = color(1500, 1400, 1200);
+            pixels.push_back(sky);
+        }
+    }
+    return make_shared<environment_map>(width, height, pixels);
+}
+
+// Outdoor scene lit only by an environment map. Most of the light comes from the tiny sun,
+// which diffuse surfaces find through the importance sampling of the map.
+void environment_lighting()
+{
+    hittable_list world;
+
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(-2.2, 1, 0), 1.0, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+    world.add(make_shared<sphere>(point3(2.2, 1, 0), 1.0, make_shared<metal>(color(0.8, 0.8, 0.8), 0.1)));
+    world = hittable_list(make_shared<bvh_node>(world));
+    world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    // Any lat-long PFM or Radiance HDR image can be used instead, e.g.:
+    //     auto sky = environment_map::load("sky.hdr");
+    auto sky = make_sun_sky(vec3(-1, 0.6, 0.5), 1024, 512);
+
+    camera_config config = {
+        16.0 / 9.0,         // Aspect ratio
+        400,                // Image width
+        100,                // Samples per pixel
+        50,                 // Max depth
+        30,                 // Vertical field of view
+        point3(0, 2, 9),    // Look from
+        point3(0, 0.8, 0),  // Look at
+        vec3(0, 1, 0),      // Vertical up vector from camera
+        0,                  // Defocus angle
+        9,                  // Focus distance
+        0,                  // Shutter open
+        0,                  // Shutter close
+        0                   // Packet size (0 = trace camera rays one at a time)
+    };
+    config.environment = sky;
+    camera cam(config);
+    cam.render(world);
+}
+
+int main()
+{
+    // Change the scene rendered here
+    switch (1)
+    {
+        case 1: final_scene();        break;
+        case 2: instanced_forest();   break;
+        case 3: bouncing_animation(); break;
+        case 4: motion_blur();        break;
+        case 5: triangle_meshes();    break;
+        case 6: cornell_box();        break;
+        case 7: environment_lighting(); break;
+    }
+}
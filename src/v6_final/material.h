@@ -2,41 +2,204 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "onb.h"
+#include "sampler.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Built-in kinds of material, used to group hits by material in the batched renderer.
+// Materials defined elsewhere are "generic" and are shaded one at a time through scatter().
+enum class material_kind { generic, lambertian, metal, dielectric };
+
+const int material_kind_count = 4;
+
+/*
+    Scatter batch
+    The hits of one bounce of the batched renderer, stored as a structure of arrays and grouped so that
+    all hits on the same kind of material form one contiguous range [begin, end).
+    Each kind of material then runs its scatter code as one loop over its range: the loop body is
+    always the same code, so there are no mispredicted branches on the material type and the compiler
+    can vectorize it, instead of jumping between lambertian, metal and dielectric for every single hit.
+*/
+struct scatter_batch
+{
+    // Inputs: the hit
+    std::vector<material *> mat;
+    std::vector<point3> origin_in;          // Origin of the incoming ray
+    std::vector<vec3> dir_in;               // Direction of the incoming ray
+    std::vector<point3> p;
+    std::vector<vec3> normal;
+    std::vector<double> t;
+    std::vector<unsigned char> front_face;
+    std::vector<double> time;
+    std::vector<std::uint64_t> pixel;       // Pixel and sample index of the path, to pick its sampler dimensions
+    std::vector<std::uint32_t> sample;
+    int bounce = 0;
+
+    // Outputs: the scattered ray
+    std::vector<color> attenuation;
+    std::vector<vec3> dir_out;
+    std::vector<unsigned char> scattered;   // 0 if the ray was absorbed
+
+    void resize(size_t n)
+    {
+        mat.resize(n);
+        origin_in.resize(n);
+        dir_in.resize(n);
+        p.resize(n);
+        normal.resize(n);
+        t.resize(n);
+        front_face.resize(n);
+        time.resize(n);
+        pixel.resize(n);
+        sample.resize(n);
+        attenuation.resize(n);
+        dir_out.resize(n);
+        scattered.resize(n);
+    }
+
+    void set_hit(size_t i, const ray &r_in, const hit_record &rec);
+
+    // Moves the current sampler (if any) to the scattering dimensions of hit i
+    void start_sample(size_t i) const
+    {
+        if (auto s = sampler::current())
+        {
+            s->start(pixel[i], sample[i]);
+            s->start_scatter(bounce);
+        }
+    }
+};
 
 class material {
   public:
+    material() : material_id(next_id()) {}
     virtual ~material() = default;
 
+    // Number of the material, in the order the materials were created starting at 1.
+    // Written to the material_id pass of the framebuffer (see framebuffer.h) to tell objects apart.
+    int id() const { return material_id; }
+
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const {
         return false;
     }
+
+    // Light given off by the surface, black for everything but lights
+    virtual color emitted(const ray& r_in, const hit_record& rec) const {
+        return color(0,0,0);
+    }
+
+    // Probability density (per unit solid angle) of scatter() sending the ray in the direction of "scattered".
+    // Materials with a pdf scatter directions with exactly this density, and the light they reflect
+    // in a direction is attenuation * scattering_pdf (the BRDF times the cosine). This is what lets
+    // the camera send rays straight to the lights and weigh them against scattered rays (see camera.h).
+    // Mirror-like materials (metal, dielectric) reflect in a single direction: they keep 0 and never
+    // sample lights directly.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+        return 0;
+    }
+
+    // Color of the surface for the denoiser (see denoise.h): what it reflects, independent of the lighting
+    virtual color base_color(const hit_record& rec) const {
+        return color(1,1,1);
+    }
+
+    virtual material_kind kind() const { return material_kind::generic; }
+
+    // Scatters the hits [begin, end) of a batch, one virtual scatter() call per hit.
+    // The built-in materials have their own loops, see scatter_span() at the end of this file.
+    static void generic_scatter_span(scatter_batch &batch, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            batch.start_sample(i);
+            hit_record rec;
+            rec.p = batch.p[i];
+            rec.normal = batch.normal[i];
+            rec.t = batch.t[i];
+            rec.front_face = batch.front_face[i];
+            // Doesn't own the material: the hit records of the bounce keep it alive while it scatters
+            rec.mat = shared_ptr<material>(shared_ptr<material>(), batch.mat[i]);
+            ray r_in(batch.origin_in[i], batch.dir_in[i], batch.time[i]);
+            ray scattered;
+            batch.scattered[i] = batch.mat[i]->scatter(r_in, rec, batch.attenuation[i], scattered);
+            batch.dir_out[i] = scattered.direction();
+        }
+    }
+  private:
+    int material_id;
+
+    static int next_id()
+    {
+        static std::atomic<int> count(0);
+        return ++count;
+    }
 };
 
-class lambertian : public material {
+inline void scatter_batch::set_hit(size_t i, const ray &r_in, const hit_record &rec)
+{
+    mat[i] = rec.mat.get();
+    origin_in[i] = r_in.origin();
+    dir_in[i] = r_in.direction();
+    p[i] = rec.p;
+    normal[i] = rec.normal;
+    t[i] = rec.t;
+    front_face[i] = rec.front_face;
+    time[i] = r_in.time();
+}
+
+// The built-in materials are final: the batched renderer shades them by kind() without calling scatter(),
+// a class derived from one of them would keep its kind and never have its own scatter() called.
+class lambertian final : public material {
 public:
     lambertian(const color& albedo) : albedo(albedo) {}
   
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
-
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
-
-        scattered = ray(rec.p, scatter_direction);
+        scattered = ray(rec.p, scatter_direction(rec.normal), r_in.time());
         // attenuation: How much light the material absorbs or reflects
         attenuation = albedo;
         return true;
       }
+
+    // scatter() picks cosine distributed directions: pdf = cos(θ) / π
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    const override {
+        auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+        return cos_theta < 0 ? 0 : cos_theta / pi;
+    }
+
+    color base_color(const hit_record& rec) const override { return albedo; }
+
+    material_kind kind() const override { return material_kind::lambertian; }
+
+    // Same as scatter(), for every hit of the range
+    static void scatter_span(scatter_batch &batch, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            batch.start_sample(i);
+            batch.dir_out[i] = scatter_direction(batch.normal[i]);
+            batch.attenuation[i] = static_cast<const lambertian *>(batch.mat[i])->albedo;
+            batch.scattered[i] = 1;
+        }
+    }
   
     private:
       color albedo;
+
+      // Cosine-weighted direction around the normal
+      static vec3 scatter_direction(const vec3 &normal)
+      {
+          return onb(normal).transform(sample_cosine_direction());
+      }
 };
 
-class metal : public material {
+class metal final : public material {
 public:
     // `albedo` defines the material's base color.
     // `fuzz` controls how blurry the reflections are; it's clamped to 1 to avoid extreme fuzziness.
@@ -44,68 +207,112 @@ public:
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        // Compute the reflection vector based on the incident ray and the surface normal
-        vec3 reflected = reflect(r_in.direction(), rec.normal);
+        vec3 reflected = scatter_direction(r_in.direction(), rec.normal);
 
-        // Apply fuzziness by adding a small random perturbation to the reflection direction
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        
         // Create the scattered ray starting from the hit point, moving in the reflected direction
-        scattered = ray(rec.p, reflected);
+        scattered = ray(rec.p, reflected, r_in.time());
 
         // The attenuation (color absorption) is determined by the material's albedo
         attenuation = albedo;
-        
-        // The function returns true only if the scattered ray is still in the valid hemisphere  
-        // (i.e., it has a positive dot product with the normal)
-        return (dot(scattered.direction(), rec.normal) > 0);
+
+        return scatters(reflected, rec.normal);
+    }
+
+    color base_color(const hit_record& rec) const override { return albedo; }
+
+    material_kind kind() const override { return material_kind::metal; }
+
+    // Same as scatter(), for every hit of the range
+    static void scatter_span(scatter_batch &batch, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            batch.start_sample(i);
+            auto m = static_cast<const metal *>(batch.mat[i]);
+            vec3 reflected = m->scatter_direction(batch.dir_in[i], batch.normal[i]);
+
+            batch.dir_out[i] = reflected;
+            batch.attenuation[i] = m->albedo;
+            batch.scattered[i] = scatters(reflected, batch.normal[i]);
+        }
     }
 
 private:
     color albedo;
     double fuzz;
+
+    vec3 scatter_direction(const vec3 &direction_in, const vec3 &normal) const
+    {
+        // Compute the reflection vector based on the incident ray and the surface normal
+        vec3 reflected = reflect(direction_in, normal);
+
+        // Apply fuzziness by adding a small random perturbation to the reflection direction
+        return unit_vector(reflected) + (fuzz * sample_unit_vector());
+    }
+
+    // The ray scatters only if it is still in the valid hemisphere
+    // (i.e., it has a positive dot product with the normal)
+    static bool scatters(const vec3 &reflected, const vec3 &normal)
+    {
+        return dot(reflected, normal) > 0;
+    }
 };
 
-class dielectric : public material {
+class dielectric final : public material {
     public:
       dielectric(double refraction_index) : refraction_index(refraction_index) {}
   
       bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
       const override {
             attenuation = color(1.0, 1.0, 1.0);
-            double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
+            scattered = ray(rec.p, scatter_direction(r_in.direction(), rec.normal, rec.front_face), r_in.time());
+            return true;
+      }
 
-            vec3 unit_direction = unit_vector(r_in.direction());
+      material_kind kind() const override { return material_kind::dielectric; }
+
+      // Same as scatter(), for every hit of the range
+      static void scatter_span(scatter_batch &batch, size_t begin, size_t end)
+      {
+            for (size_t i = begin; i < end; i++)
+            {
+                batch.start_sample(i);
+                auto d = static_cast<const dielectric *>(batch.mat[i]);
+                batch.dir_out[i] = d->scatter_direction(batch.dir_in[i], batch.normal[i], batch.front_face[i]);
+                batch.attenuation[i] = color(1.0, 1.0, 1.0);
+                batch.scattered[i] = 1;
+            }
+      }
+  
+    private:
+      // Refractive index in vacuum or air, or the ratio of the material's refractive index over
+      // the refractive index of the enclosing media
+      double refraction_index;
+
+      vec3 scatter_direction(const vec3 &direction_in, const vec3 &normal, bool front_face) const
+      {
+            double ri = front_face ? (1.0/refraction_index) : refraction_index;
+
+            vec3 unit_direction = unit_vector(direction_in);
 
             // When light hits a surface, some of it reflects and some refracts (passes through). The amount of light that reflects depends on:
             // - Incident angle (𝜃): Light hitting at a steeper angle reflects more.
             // - Material properties: Different materials have different refractive indices (η), which influence how much light reflects.
 
             // Finds critical angle to ensure if reflection happens or refraction
-            double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+            double cos_theta = std::fmin(dot(-unit_direction, normal), 1.0);
             double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
 
             bool cannot_refract = ri * sin_theta > 1.0;
-            vec3 direction;
 
             // Use Schlick's approximation for reflectance.
-            // reflectance(cos_theta, ri) > random_double()
+            // reflectance(cos_theta, ri) > sample_1d()
             // This takes into account the material properties and the incident angle to determine whether the ray reflects or refracts.
-            if (cannot_refract || reflectance(cos_theta, ri) > random_double())
-                direction = reflect(unit_direction, rec.normal);
-            else
-                direction = refract(unit_direction, rec.normal, ri);
-
-            scattered = ray(rec.p, direction);
-
-            return true;
+            if (cannot_refract || reflectance(cos_theta, ri) > sample_1d())
+                return reflect(unit_direction, normal);
+            return refract(unit_direction, normal, ri);
       }
-  
-    private:
-      // Refractive index in vacuum or air, or the ratio of the material's refractive index over
-      // the refractive index of the enclosing media
-      double refraction_index;
-      
+
       static double reflectance(double cosine, double refraction_index) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
@@ -114,6 +321,37 @@ class dielectric : public material {
     }
 
   };
-  
+
+// Light emitting material: it doesn't reflect anything, it only gives off light of color "emit".
+// The color can go above 1, a small bright light is needed to light up a whole scene.
+class diffuse_light : public material {
+public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    color emitted(const ray& r_in, const hit_record& rec) const override {
+        return emit;
+    }
+
+    // The tint of the light, brought back to [0, 1]
+    color base_color(const hit_record& rec) const override {
+        auto brightest = std::fmax(emit.x(), std::fmax(emit.y(), emit.z()));
+        return brightest > 0 ? emit / brightest : color(0,0,0);
+    }
+
+private:
+    color emit;
+};
+
+// Runs the scatter loop of one kind of material over the hits [begin, end) of a batch
+inline void scatter_span(material_kind kind, scatter_batch &batch, size_t begin, size_t end)
+{
+    switch (kind)
+    {
+        case material_kind::lambertian: lambertian::scatter_span(batch, begin, end); break;
+        case material_kind::metal:      metal::scatter_span(batch, begin, end);      break;
+        case material_kind::dielectric: dielectric::scatter_span(batch, begin, end); break;
+        default:                        material::generic_scatter_span(batch, begin, end); break;
+    }
+}
 
 #endif
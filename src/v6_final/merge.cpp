@@ -0,0 +1,73 @@
+#include "commons.h"
+#include "framebuffer.h"
+#include "image_io.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+    Merge tool
+    Adds up the accumulation files (camera_config::accumulation_output) of renders of the same image,
+    for example two workers which rendered samples 0-249 and 250-499 of every pixel (first_sample):
+        ./build/merge v6.acc samples_0.acc samples_250.acc
+        ./build/tonemap v6.acc --png v6.png
+    The files hold sums of samples, so adding them is the same as one render of all the samples.
+    --weight w   multiplies the samples of the files after it by w (default 1): a render whose samples
+                 should count less in the average, or a negative weight to take samples away
+    The result has the passes of the first file, passes missing from a later file are left as they are.
+*/
+
+int usage()
+{
+    std::cerr << "Usage: merge <output.acc> <input.acc> [[--weight <w>] <input.acc>]...\n";
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+        return usage();
+
+    framebuffer merged;
+    double weight = 1;
+    int inputs = 0;
+    for (int a = 2; a < argc; a++)
+    {
+        if (std::strcmp(argv[a], "--weight") == 0)
+        {
+            if (a + 1 >= argc)
+                return usage();
+            weight = std::atof(argv[++a]);
+            continue;
+        }
+
+        framebuffer input;
+        if (!read_accumulation(argv[a], input))
+        {
+            std::cerr << "ERROR: Could not load '" << argv[a] << "'.\n";
+            return 1;
+        }
+        if (inputs == 0)
+            merged.reset(input.width(), input.height(), input.extra_passes());
+        else if (input.width() != merged.width() || input.height() != merged.height())
+        {
+            std::cerr << "ERROR: '" << argv[a] << "' is " << input.width() << " x " << input.height()
+                      << ", not " << merged.width() << " x " << merged.height() << ".\n";
+            return 1;
+        }
+        merged.accumulate(input, 0, 0, weight);
+        inputs++;
+    }
+    if (inputs == 0)
+        return usage();
+
+    double samples = 0;
+    for (size_t pixel = 0; pixel < merged.pixel_count(); pixel++)
+        samples += merged.plane(pass::sample_count)[pixel];
+    if (!write_accumulation(argv[1], merged))
+        return 1;
+    std::clog << "Wrote '" << argv[1] << "', " << samples / merged.pixel_count() << " samples per pixel\n";
+    return 0;
+}
@@ -0,0 +1,175 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "triangle_mesh.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+/*
+    Wavefront OBJ loader
+    OBJ is a plain text format, one element per line:
+        v  x y z            -> vertex position
+        vn x y z            -> vertex normal
+        f  a b c ...        -> face, as 1-based indices into the vertex list
+    Face corners can also be written as "v/vt", "v//vn" or "v/vt/vn", and negative indices
+    count backwards from the last vertex read so far. Faces with more than 3 corners are split
+    into a fan of triangles. Texture coordinates, groups and materials are ignored.
+
+    The file is streamed one line at a time straight into the mesh arrays, nothing else
+    is kept in memory, so big meshes only cost the size of the final mesh_data.
+*/
+class obj_loader
+{
+public:
+    // Returns nullptr if the file can't be read
+    static shared_ptr<mesh_data> load(const std::string &filename)
+    {
+        std::ifstream file(filename);
+        if (!file)
+        {
+            std::cerr << "ERROR: Could not load OBJ file '" << filename << "'.\n";
+            return nullptr;
+        }
+
+        auto data = make_shared<mesh_data>();
+        std::vector<vec3> file_normals;           // Normals as listed in the file ("vn")
+        std::vector<std::int64_t> vertex_normal;  // For every vertex, the file normal used with it (-1 if none)
+        bool any_normals = false;
+
+        std::string line;
+        std::vector<std::int64_t> face_vertices, face_normals;
+        while (std::getline(file, line))
+        {
+            const char *s = line.c_str();
+            while (*s == ' ' || *s == '\t')
+                s++;
+
+            if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+            {
+                char *end;
+                double x = std::strtod(s + 2, &end);
+                double y = std::strtod(end, &end);
+                double z = std::strtod(end, &end);
+                data->vertices.push_back(point3(x, y, z));
+                vertex_normal.push_back(-1);
+            }
+            else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t'))
+            {
+                char *end;
+                double x = std::strtod(s + 3, &end);
+                double y = std::strtod(end, &end);
+                double z = std::strtod(end, &end);
+                file_normals.push_back(vec3(x, y, z));
+            }
+            else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+            {
+                face_vertices.clear();
+                face_normals.clear();
+                parse_face(s + 2, data->vertices.size(), file_normals.size(), face_vertices, face_normals);
+
+                // Fan triangulation: (0, 1, 2), (0, 2, 3), (0, 3, 4), ...
+                for (size_t k = 1; k + 1 < face_vertices.size(); k++)
+                {
+                    size_t corners[3] = {0, k, k + 1};
+                    for (int c = 0; c < 3; c++)
+                    {
+                        auto vi = face_vertices[corners[c]];
+                        auto ni = face_normals[corners[c]];
+                        if (ni >= 0)
+                        {
+                            vertex_normal[vi] = ni;
+                            any_normals = true;
+                        }
+                        data->indices.push_back(static_cast<std::uint32_t>(vi));
+                    }
+                }
+            }
+        }
+
+        // The mesh stores one normal per vertex. OBJ allows a different normal at every corner,
+        // the last one seen for a vertex wins, which is exact for meshes exported with smooth normals.
+        if (any_normals)
+        {
+            data->normals.resize(data->vertices.size());
+            for (size_t i = 0; i < data->vertices.size(); i++)
+                data->normals[i] = vertex_normal[i] >= 0 ? unit_vector(file_normals[vertex_normal[i]]) : vec3(0, 0, 0);
+        }
+
+        std::clog << "Loaded '" << filename << "': " << data->vertices.size() << " vertices, "
+                  << data->triangle_count() << " triangles\n";
+        return data;
+    }
+
+private:
+    // Parses the corners of a face line into 0-based vertex and normal indices (-1 for no normal).
+    // Corners referencing vertices that don't exist make the whole face get skipped.
+    static void parse_face(const char *s, size_t vertex_count, size_t normal_count,
+                           std::vector<std::int64_t> &vertices, std::vector<std::int64_t> &normals)
+    {
+        char *end;
+        while (true)
+        {
+            while (*s == ' ' || *s == '\t')
+                s++;
+            if (*s == '\0' || *s == '\r' || *s == '#')
+                break;
+
+            std::int64_t v = std::strtoll(s, &end, 10);
+            if (end == s)
+                break;
+            s = end;
+            std::int64_t n = 0;
+            if (*s == '/')
+            {
+                s++;
+                if (*s != '/')
+                {
+                    std::strtoll(s, &end, 10); // Texture coordinate, not used
+                    s = end;
+                }
+                if (*s == '/')
+                {
+                    s++;
+                    n = std::strtoll(s, &end, 10);
+                    s = end;
+                }
+            }
+            // Skip anything left in this corner
+            while (*s != '\0' && *s != ' ' && *s != '\t')
+                s++;
+
+            v = resolve_index(v, vertex_count);
+            n = n == 0 ? -1 : resolve_index(n, normal_count);
+            if (v < 0)
+            {
+                vertices.clear();
+                normals.clear();
+                return;
+            }
+            vertices.push_back(v);
+            normals.push_back(n);
+        }
+    }
+
+    // OBJ indices start at 1, negative indices are relative to the end of the list
+    static std::int64_t resolve_index(std::int64_t index, size_t count)
+    {
+        std::int64_t resolved = index > 0 ? index - 1 : static_cast<std::int64_t>(count) + index;
+        if (resolved < 0 || resolved >= static_cast<std::int64_t>(count))
+            return -1;
+        return resolved;
+    }
+};
+
+// Loads an OBJ file as a single triangle_mesh hittable, returns nullptr if the file can't be read
+inline shared_ptr<triangle_mesh> load_obj(const std::string &filename, shared_ptr<material> mat)
+{
+    auto data = obj_loader::load(filename);
+    if (!data)
+        return nullptr;
+    return make_shared<triangle_mesh>(data, mat);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "vec3.h"
+
+// Orthonormal basis: three perpendicular unit vectors u, v, w built around a given direction w.
+// Directions sampled around the z axis are turned into directions around w with transform().
+class onb
+{
+public:
+    onb(const vec3 &n)
+    {
+        // Branchless construction (Duff et al. 2017): u and v come straight out of a closed form in
+        // the components of w, no helper vector to pick and no extra normalization
+        axis[2] = unit_vector(n);
+        const vec3 &w = axis[2];
+        auto sign = std::copysign(1.0, w.z());
+        auto a = -1 / (sign + w.z());
+        auto b = w.x() * w.y() * a;
+        axis[0] = vec3(1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+        axis[1] = vec3(b, sign + w.y() * w.y() * a, -w.y());
+    }
+
+    const vec3 &u() const { return axis[0]; }
+    const vec3 &v() const { return axis[1]; }
+    const vec3 &w() const { return axis[2]; }
+
+    // Converts a vector given in the basis coordinates to world coordinates
+    vec3 transform(const vec3 &local) const
+    {
+        return local[0] * axis[0] + local[1] * axis[1] + local[2] * axis[2];
+    }
+
+private:
+    vec3 axis[3];
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use for parallel work.
+// hardware_concurrency() is allowed to return 0 when it can't tell, so fall back to 1.
+inline unsigned int thread_count()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Calls body(i) for every i in [begin, end), on thread_count() threads.
+// The threads take the next index from a shared counter, so a slow item doesn't hold up a whole
+// fixed share of the range. body must be safe to call from several threads at once.
+template <typename Function>
+void parallel_for(int begin, int end, Function body)
+{
+    std::atomic<int> next(begin);
+    auto work = [&]() {
+        for (int i = next++; i < end; i = next++)
+            body(i);
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < thread_count() && int(t) < end - begin; t++)
+        workers.emplace_back(work);
+    work();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef PLANE_H
+#define PLANE_H
+
+#include "hittable.h"
+#include "sampler.h"
+
+/*
+    Infinite plane
+    All points P with dot(n, P) = D, where n is the plane normal and D = dot(n, Q) for any point Q on the plane.
+    Substituting the ray P(t) = O + t * d:
+        dot(n, O + t * d) = D
+        => t = (D - dot(n, O)) / dot(n, d)
+    A single divide, no square root and no large numbers like the radius 1000 ground sphere.
+    If dot(n, d) is 0 the ray is parallel to the plane and never hits it.
+
+    The plane has an infinite bounding box, put it next to a bvh_node rather than inside it:
+    inside, its box would enclose every other box in the tree and make the BVH useless.
+        world = hittable_list(make_shared<bvh_node>(objects));
+        world.add(make_shared<plane>(point3(0,0,0), vec3(0,1,0), ground_material));
+*/
+class plane : public hittable
+{
+public:
+    plane(const point3 &point, const vec3 &normal, shared_ptr<material> mat)
+        : normal(unit_vector(normal)), mat(mat)
+    {
+        D = dot(this->normal, point);
+
+        // Only a plane perpendicular to an axis has a finite thickness on that axis
+        auto x = this->normal.y() == 0 && this->normal.z() == 0 ? interval(point.x(), point.x()) : interval::universe;
+        auto y = this->normal.x() == 0 && this->normal.z() == 0 ? interval(point.y(), point.y()) : interval::universe;
+        auto z = this->normal.x() == 0 && this->normal.y() == 0 ? interval(point.z(), point.z()) : interval::universe;
+        bbox = aabb(x, y, z);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        auto denom = dot(normal, r.direction());
+        if (denom == 0)
+            return false;
+
+        auto t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, normal);
+        rec.mat = mat;
+        return true;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        auto denom = dot(normal, r.direction());
+        return denom != 0 && ray_t.surrounds((D - dot(normal, r.origin())) / denom);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    vec3 normal;
+    double D;
+    shared_ptr<material> mat;
+    aabb bbox;
+};
+
+/*
+    Planar shapes: a plane hit followed by a test of where on the plane the hit is.
+    The plane is described by a corner Q and two edge vectors u and v, a hit point P is
+        P = Q + α * u + β * v
+    and (α, β) are the coordinates of P in the plane, found with
+        w = n / dot(n, n)     where n = cross(u, v)
+        α = dot(w, cross(p, v))
+        β = dot(w, cross(u, p))    with p = P - Q
+    Every shape only has to decide if (α, β) is inside it.
+*/
+class planar : public hittable
+{
+public:
+    planar(const point3 &Q, const vec3 &u, const vec3 &v, shared_ptr<material> mat)
+        : Q(Q), u(u), v(v), mat(mat)
+    {
+        auto n = cross(u, v);
+        normal = unit_vector(n);
+        D = dot(normal, Q);
+        w = n / dot(n, n);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        double t;
+        if (!hit_shape(r, ray_t, t))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, normal);
+        rec.mat = mat;
+        return true;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double t;
+        return hit_shape(r, ray_t, t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    /*
+        Sampling a planar light
+        Shapes pick a point uniformly on their surface, a density of 1 / area per unit area.
+        A small patch dA at distance d, seen at an angle θ from its normal, covers a solid angle
+            dω = dA * cos(θ) / d²
+        so per unit solid angle the density is d² / (cos(θ) * area).
+    */
+    double pdf_value(const point3 &origin, const vec3 &direction, double time) const override
+    {
+        double t;
+        if (!hit_shape(ray(origin, direction), interval(0.001, infinity), t))
+            return 0;
+
+        auto distance_squared = t * t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, normal) / direction.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+protected:
+    point3 Q;
+    vec3 u, v;
+    vec3 w;
+    vec3 normal;
+    double D;
+    double area;
+    shared_ptr<material> mat;
+    aabb bbox;
+
+    virtual bool is_interior(double a, double b) const = 0;
+
+private:
+    // Finds where the ray crosses the plane and checks that the point is inside the shape
+    bool hit_shape(const ray &r, const interval &ray_t, double &t) const
+    {
+        auto denom = dot(normal, r.direction());
+        if (denom == 0)
+            return false;
+
+        t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        auto intersection = r.at(t);
+        vec3 planar_hitpt_vector = intersection - Q;
+        auto alpha = dot(w, cross(planar_hitpt_vector, v));
+        auto beta = dot(w, cross(u, planar_hitpt_vector));
+
+        return is_interior(alpha, beta);
+    }
+};
+
+// Parallelogram with a corner at Q and edges u and v.
+// For an axis-aligned rectangle, use edges along two axes, e.g. u = (w, 0, 0) and v = (0, 0, h).
+class quad : public planar
+{
+public:
+    quad(const point3 &Q, const vec3 &u, const vec3 &v, shared_ptr<material> mat) : planar(Q, u, v, mat)
+    {
+        // Box around the four corners
+        bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+        area = cross(u, v).length();
+    }
+
+    vec3 random(const point3 &origin, double time) const override
+    {
+        auto s = sample_2d();
+        auto p = Q + (s.x() * u) + (s.y() * v);
+        return p - origin;
+    }
+
+protected:
+    bool is_interior(double a, double b) const override
+    {
+        interval unit_interval = interval(0, 1);
+        return unit_interval.contains(a) && unit_interval.contains(b);
+    }
+};
+
+// Disk with a center, a normal and a radius
+class disk : public planar
+{
+public:
+    disk(const point3 &center, const vec3 &normal, double radius, shared_ptr<material> mat)
+        : planar(center, radius * disk_axis(normal), radius * unit_vector(cross(normal, disk_axis(normal))), mat)
+    {
+        // Extent of a disk along each axis: radius * sqrt(1 - n_axis²)
+        auto n = unit_vector(normal);
+        auto e = vec3(radius * std::sqrt(std::fmax(0, 1 - n.x() * n.x())),
+                      radius * std::sqrt(std::fmax(0, 1 - n.y() * n.y())),
+                      radius * std::sqrt(std::fmax(0, 1 - n.z() * n.z())));
+        bbox = aabb(center - e, center + e);
+        area = pi * radius * radius;
+    }
+
+    vec3 random(const point3 &origin, double time) const override
+    {
+        auto p = sample_in_unit_disk();
+        return Q + p.x() * u + p.y() * v - origin;
+    }
+
+protected:
+    // Q is the center and u, v are two perpendicular radii, so the disk is α² + β² <= 1
+    bool is_interior(double a, double b) const override
+    {
+        return a * a + b * b <= 1;
+    }
+
+private:
+    // Any unit vector perpendicular to the normal
+    static vec3 disk_axis(const vec3 &normal)
+    {
+        auto n = unit_vector(normal);
+        auto helper = std::fabs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        return unit_vector(cross(n, helper));
+    }
+};
+
+#endif
@@ -0,0 +1,576 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    PNG writer
+    A PNG file is a few chunks around the pixels, which are stored as a zlib (deflate) stream:
+        1. filtering: every row is replaced by its difference to a prediction from the pixels left of it
+           and/or above it (5 choices per row), smooth images become mostly small numbers
+        2. LZ77: repeated byte strings are replaced by (length, distance) references to an earlier copy
+        3. Huffman coding: frequent bytes and lengths get short codes, rare ones longer codes
+    Deflate is normally one sequential stream. Here the rows are cut into bands which are compressed
+    independently on all threads, each band ending on a byte boundary, and the pieces are simply
+    concatenated (the same trick as pigz). A band can't refer back to data of the band before it,
+    which costs very little with bands of a megabyte.
+*/
+
+// Bits are written least significant first, as deflate expects
+class bit_writer
+{
+public:
+    std::vector<unsigned char> bytes;
+
+    void put(std::uint32_t value, int count)
+    {
+        buffer |= std::uint64_t(value) << fill;
+        fill += count;
+        while (fill >= 8)
+        {
+            bytes.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            fill -= 8;
+        }
+    }
+
+    void align()
+    {
+        if (fill > 0)
+            put(0, 8 - fill);
+    }
+
+private:
+    std::uint64_t buffer = 0;
+    int fill = 0;
+};
+
+// Canonical Huffman code of a deflate block: code lengths, and the codes already bit reversed
+// (deflate stores Huffman codes starting from their most significant bit)
+struct huffman_code
+{
+    std::vector<int> length;
+    std::vector<std::uint32_t> code;
+
+    // Optimal code lengths for the frequencies, no longer than max_length bits
+    void build(std::vector<std::uint32_t> freq, int max_length)
+    {
+        auto n = freq.size();
+
+        // Two used symbols at least, a code with a single symbol of length 0 isn't valid
+        int used = 0;
+        for (auto f : freq)
+            used += f > 0;
+        for (size_t s = 0; s < n && used < 2; s++)
+            if (freq[s] == 0)
+            {
+                freq[s] = 1;
+                used++;
+            }
+
+        length.assign(n, 0);
+        for (;;)
+        {
+            // Huffman's algorithm: merge the two lightest nodes until one is left
+            std::vector<std::pair<int, int>> children;  // Of node n + i
+            std::priority_queue<std::pair<std::uint64_t, int>, std::vector<std::pair<std::uint64_t, int>>,
+                                std::greater<std::pair<std::uint64_t, int>>> heap;
+            for (size_t s = 0; s < n; s++)
+                if (freq[s] > 0)
+                    heap.push(std::make_pair(std::uint64_t(freq[s]), int(s)));
+            while (heap.size() > 1)
+            {
+                auto a = heap.top();
+                heap.pop();
+                auto b = heap.top();
+                heap.pop();
+                children.push_back(std::make_pair(a.second, b.second));
+                heap.push(std::make_pair(a.first + b.first, int(n + children.size() - 1)));
+            }
+
+            // Depth of every leaf, walking down from the root (the last node made)
+            std::vector<int> depth(n + children.size(), 0);
+            int deepest = 0;
+            for (size_t i = children.size(); i-- > 0;)
+            {
+                int d = depth[n + i] + 1;
+                depth[children[i].first] = d;
+                depth[children[i].second] = d;
+            }
+            for (size_t s = 0; s < n; s++)
+            {
+                length[s] = freq[s] > 0 ? depth[s] : 0;
+                deepest = std::max(deepest, length[s]);
+            }
+            if (deepest <= max_length)
+                break;
+
+            // Too deep: flatten the frequencies and try again, all equal ends as a balanced tree
+            for (auto &f : freq)
+                if (f > 0)
+                    f = (f >> 1) | 1;
+        }
+
+        // Canonical codes: shorter codes first, in symbol order within a length (RFC 1951, 3.2.2)
+        std::vector<std::uint32_t> count(max_length + 1, 0), next(max_length + 1, 0);
+        for (auto l : length)
+            if (l > 0)
+                count[l]++;
+        for (int l = 1; l <= max_length; l++)
+            next[l] = (next[l - 1] + count[l - 1]) << 1;
+        code.assign(n, 0);
+        for (size_t s = 0; s < n; s++)
+        {
+            int l = length[s];
+            if (l == 0)
+                continue;
+            std::uint32_t c = next[l]++;
+            std::uint32_t reversed = 0;
+            for (int b = 0; b < l; b++)
+                reversed |= ((c >> b) & 1) << (l - 1 - b);
+            code[s] = reversed;
+        }
+    }
+
+    void put(bit_writer &out, int symbol) const { out.put(code[symbol], length[symbol]); }
+};
+
+/*
+    Deflate compressor for one band
+    Output is a sequence of dynamic Huffman blocks (or stored blocks when the data doesn't compress),
+    ending with the final block if "last", or else with an empty stored block which leaves the
+    stream on a byte boundary so the next band can be appended.
+*/
+class deflate_band
+{
+public:
+    static std::vector<unsigned char> compress(const unsigned char *data, size_t size, bool last)
+    {
+        deflate_band band(data, size);
+        band.run(last);
+        return std::move(band.out.bytes);
+    }
+
+private:
+    // One LZ77 item: a literal byte (length 0), or a copy of "length" bytes from "distance" back
+    struct token
+    {
+        std::uint16_t length;
+        std::uint16_t value;    // The byte, or the distance
+    };
+
+    static const int window = 32768;
+    static const int min_match = 3;
+    static const int max_match = 258;
+    static const int max_chain = 32;        // Earlier positions tried per match, more is slower and smaller
+    static const int nice_match = 128;      // Stop looking once a match is this long
+    static const int hash_bits = 15;
+    static const size_t block_tokens = 1 << 16;
+
+    const unsigned char *data;
+    size_t size;
+    bit_writer out;
+    std::vector<token> tokens;
+    size_t block_start = 0;                 // First byte of data in the current block
+
+    deflate_band(const unsigned char *data, size_t size) : data(data), size(size) {}
+
+    std::uint32_t hash(size_t p) const
+    {
+        std::uint32_t v = data[p] | (data[p + 1] << 8) | (data[p + 2] << 16);
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    void run(bool last)
+    {
+        std::vector<std::int32_t> head(size_t(1) << hash_bits, -1);
+        std::vector<std::int32_t> previous(size);
+        auto insert = [&](size_t p) {
+            if (p + min_match <= size)
+            {
+                auto h = hash(p);
+                previous[p] = head[h];
+                head[h] = std::int32_t(p);
+            }
+        };
+
+        size_t p = 0;
+        while (p < size)
+        {
+            int best_length = 0, best_distance = 0;
+            if (p + min_match <= size)
+            {
+                int limit = int(std::min<size_t>(max_match, size - p));
+                auto candidate = head[hash(p)];
+                for (int chain = 0; candidate >= 0 && p - candidate <= window && chain < max_chain; chain++)
+                {
+                    int length = 0;
+                    while (length < limit && data[candidate + length] == data[p + length])
+                        length++;
+                    if (length > best_length)
+                    {
+                        best_length = length;
+                        best_distance = int(p - candidate);
+                        if (length >= nice_match)
+                            break;
+                    }
+                    candidate = previous[candidate];
+                }
+            }
+
+            if (best_length >= min_match)
+            {
+                tokens.push_back({std::uint16_t(best_length), std::uint16_t(best_distance)});
+                for (int k = 0; k < best_length; k++)
+                    insert(p + k);
+                p += best_length;
+            }
+            else
+            {
+                tokens.push_back({0, data[p]});
+                insert(p);
+                p++;
+            }
+
+            if (tokens.size() >= block_tokens && p < size)
+                write_block(p, false);
+        }
+        write_block(p, last);
+
+        if (!last)
+        {
+            // Empty stored block: 3 header bits, then aligned LEN = 0 and NLEN = ~0
+            out.put(0, 3);
+            out.align();
+            out.put(0, 16);
+            out.put(0xffff, 16);
+        }
+        out.align();
+    }
+
+    // Length and distance codes (RFC 1951, 3.2.5): a code number, plus extra bits for the exact value
+    static int length_code(int length, int &extra_bits, int &extra)
+    {
+        static const int base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                     35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int bits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                     3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        int c = int(std::upper_bound(base, base + 29, length) - base) - 1;
+        extra_bits = bits[c];
+        extra = length - base[c];
+        return c;
+    }
+
+    static int distance_code(int distance, int &extra_bits, int &extra)
+    {
+        static const int base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                     257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const int bits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                     7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        int c = int(std::upper_bound(base, base + 30, distance) - base) - 1;
+        extra_bits = bits[c];
+        extra = distance - base[c];
+        return c;
+    }
+
+    // Writes the tokens since the last block, which cover data [block_start, end)
+    void write_block(size_t end, bool final_block)
+    {
+        std::vector<std::uint32_t> literal_freq(286, 0), distance_freq(30, 0);
+        literal_freq[256] = 1;  // End of block
+        int extra_bits, extra;
+        for (const auto &t : tokens)
+        {
+            if (t.length == 0)
+                literal_freq[t.value]++;
+            else
+            {
+                literal_freq[257 + length_code(t.length, extra_bits, extra)]++;
+                distance_freq[distance_code(t.value, extra_bits, extra)]++;
+            }
+        }
+
+        huffman_code literals, distances;
+        literals.build(literal_freq, 15);
+        distances.build(distance_freq, 15);
+
+        // The code lengths of both codes are sent run-length encoded: 16 repeats the previous length
+        // 3-6 times, 17 and 18 give 3-10 and 11-138 zeros
+        int literal_count = 286, distance_count = 30;
+        while (literal_count > 257 && literals.length[literal_count - 1] == 0)
+            literal_count--;
+        while (distance_count > 1 && distances.length[distance_count - 1] == 0)
+            distance_count--;
+        std::vector<int> lengths(literals.length.begin(), literals.length.begin() + literal_count);
+        lengths.insert(lengths.end(), distances.length.begin(), distances.length.begin() + distance_count);
+
+        std::vector<std::pair<int, int>> runs;  // (symbol, extra bits value)
+        for (size_t i = 0; i < lengths.size();)
+        {
+            size_t j = i;
+            while (j < lengths.size() && lengths[j] == lengths[i])
+                j++;
+            int run = int(j - i);
+            if (lengths[i] == 0 && run >= 3)
+            {
+                run = std::min(run, 138);
+                runs.push_back(run >= 11 ? std::make_pair(18, run - 11) : std::make_pair(17, run - 3));
+            }
+            else if (lengths[i] != 0 && run >= 4)
+            {
+                run = std::min(run, 7);
+                runs.push_back(std::make_pair(lengths[i], 0));
+                runs.push_back(std::make_pair(16, run - 4));
+            }
+            else
+            {
+                run = 1;
+                runs.push_back(std::make_pair(lengths[i], 0));
+            }
+            i += run;
+        }
+
+        std::vector<std::uint32_t> length_freq(19, 0);
+        for (const auto &r : runs)
+            length_freq[r.first]++;
+        huffman_code length_code_lengths;
+        length_code_lengths.build(length_freq, 7);
+
+        static const int order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        int order_count = 19;
+        while (order_count > 4 && length_code_lengths.length[order[order_count - 1]] == 0)
+            order_count--;
+
+        // Size of the block with these codes, against storing the bytes as they are
+        static const int run_extra_bits[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+        std::uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * order_count;
+        for (const auto &r : runs)
+            dynamic_bits += length_code_lengths.length[r.first] + run_extra_bits[r.first];
+        for (int s = 0; s < 286; s++)
+            dynamic_bits += std::uint64_t(literal_freq[s]) * literals.length[s];
+        for (int s = 0; s < 30; s++)
+            dynamic_bits += std::uint64_t(distance_freq[s]) * distances.length[s];
+        for (const auto &t : tokens)
+            if (t.length != 0)
+            {
+                length_code(t.length, extra_bits, extra);
+                dynamic_bits += extra_bits;
+                distance_code(t.value, extra_bits, extra);
+                dynamic_bits += extra_bits;
+            }
+        auto stored_bytes = end - block_start;
+        std::uint64_t stored_bits = 8 * (stored_bytes + 5 * (stored_bytes / 65535 + 1)) + 8;
+
+        if (stored_bits < dynamic_bits)
+            write_stored(end, final_block);
+        else
+        {
+            out.put(final_block ? 1 : 0, 1);
+            out.put(2, 2);
+            out.put(std::uint32_t(literal_count - 257), 5);
+            out.put(std::uint32_t(distance_count - 1), 5);
+            out.put(std::uint32_t(order_count - 4), 4);
+            for (int k = 0; k < order_count; k++)
+                out.put(std::uint32_t(length_code_lengths.length[order[k]]), 3);
+            for (const auto &r : runs)
+            {
+                length_code_lengths.put(out, r.first);
+                if (run_extra_bits[r.first])
+                    out.put(std::uint32_t(r.second), run_extra_bits[r.first]);
+            }
+
+            for (const auto &t : tokens)
+            {
+                if (t.length == 0)
+                {
+                    literals.put(out, t.value);
+                    continue;
+                }
+                int c = length_code(t.length, extra_bits, extra);
+                literals.put(out, 257 + c);
+                out.put(std::uint32_t(extra), extra_bits);
+                c = distance_code(t.value, extra_bits, extra);
+                distances.put(out, c);
+                out.put(std::uint32_t(extra), extra_bits);
+            }
+            literals.put(out, 256);
+        }
+
+        tokens.clear();
+        block_start = end;
+    }
+
+    // Stored blocks: the bytes as they are, at most 65535 per block
+    void write_stored(size_t end, bool final_block)
+    {
+        size_t p = block_start;
+        do
+        {
+            auto n = std::min<size_t>(65535, end - p);
+            bool last_piece = p + n == end;
+            out.put(final_block && last_piece ? 1 : 0, 1);
+            out.put(0, 2);
+            out.align();
+            out.put(std::uint32_t(n), 16);
+            out.put(std::uint32_t(~n & 0xffff), 16);
+            for (size_t k = 0; k < n; k++)
+                out.put(data[p + k], 8);
+            p += n;
+        } while (p < end);
+    }
+};
+
+// CRC-32 of the PNG chunks (the same as zip and gzip)
+inline std::uint32_t crc32(const unsigned char *data, size_t size, std::uint32_t crc = 0)
+{
+    static const std::vector<std::uint32_t> table = [] {
+        std::vector<std::uint32_t> t(256);
+        for (std::uint32_t n = 0; n < 256; n++)
+        {
+            std::uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Adler-32 checksum at the end of the zlib stream
+inline std::uint32_t adler32(const unsigned char *data, size_t size)
+{
+    std::uint32_t a = 1, b = 0;
+    while (size > 0)
+    {
+        // 5552 bytes is the most that can be summed before b could overflow
+        size_t n = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < n; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// Filters row j of 8-bit RGB pixels into out (the filter type byte, then the filtered bytes).
+// All 5 filters are tried, the one with the smallest sum of absolute values usually compresses best.
+inline void filter_row(const unsigned char *rgb, int width, int j, unsigned char *out)
+{
+    const int bpp = 3;
+    auto row_bytes = size_t(width) * bpp;
+    const unsigned char *row = rgb + j * row_bytes;
+    const unsigned char *above = j > 0 ? row - row_bytes : nullptr;
+
+    std::vector<unsigned char> candidate(row_bytes);
+    std::uint64_t best_score = ~std::uint64_t(0);
+    for (int type = 0; type < 5; type++)
+    {
+        std::uint64_t score = 0;
+        for (size_t i = 0; i < row_bytes; i++)
+        {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = above ? above[i] : 0;
+            int c = above && i >= bpp ? above[i - bpp] : 0;
+            int predicted = 0;
+            switch (type)
+            {
+                case 1: predicted = a; break;
+                case 2: predicted = b; break;
+                case 3: predicted = (a + b) / 2; break;
+                case 4:
+                {
+                    // Paeth: whichever of left, above and upper left is closest to left + above - upper left
+                    int p = a + b - c;
+                    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                    predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    break;
+                }
+            }
+            candidate[i] = static_cast<unsigned char>(row[i] - predicted);
+            score += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+        }
+        if (score < best_score)
+        {
+            best_score = score;
+            out[0] = static_cast<unsigned char>(type);
+            std::copy(candidate.begin(), candidate.end(), out + 1);
+        }
+    }
+}
+
+// Writes 8-bit RGB pixels (3 bytes per pixel, rows from the top) as a PNG file
+inline bool write_png(const std::string &filename, int width, int height, const std::vector<unsigned char> &rgb)
+{
+    auto row_bytes = size_t(width) * 3;
+    auto line = row_bytes + 1;
+    std::vector<unsigned char> filtered(line * height);
+    parallel_for(0, height, [&](int j) { filter_row(rgb.data(), width, j, &filtered[j * line]); });
+
+    // Bands of about a megabyte, compressed in parallel
+    int band_rows = int(std::max<size_t>(1, (size_t(1) << 20) / line));
+    int band_count = (height + band_rows - 1) / band_rows;
+    std::vector<std::vector<unsigned char>> bands(band_count);
+    parallel_for(0, band_count, [&](int b) {
+        int first = b * band_rows;
+        int rows = std::min(band_rows, height - first);
+        bands[b] = deflate_band::compress(&filtered[first * line], rows * line, b == band_count - 1);
+    });
+
+    std::vector<unsigned char> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    auto put_u32 = [](std::vector<unsigned char> &v, std::uint32_t x) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            v.push_back(static_cast<unsigned char>(x >> shift));
+    };
+    // Chunk: length, type, data, CRC of type and data
+    auto chunk = [&](const char *type, const std::vector<unsigned char> &data) {
+        put_u32(png, std::uint32_t(data.size()));
+        auto start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        put_u32(png, crc32(&png[start], png.size() - start));
+    };
+
+    std::vector<unsigned char> header;
+    put_u32(header, std::uint32_t(width));
+    put_u32(header, std::uint32_t(height));
+    header.insert(header.end(), {8, 2, 0, 0, 0});  // 8 bits per component, RGB, deflate, filters, no interlace
+    chunk("IHDR", header);
+
+    // zlib stream: 2 byte header (deflate, 32K window), the bands, Adler-32 of the uncompressed data
+    std::vector<unsigned char> stream = {0x78, 0x01};
+    for (const auto &band : bands)
+        stream.insert(stream.end(), band.begin(), band.end());
+    put_u32(stream, adler32(filtered.data(), filtered.size()));
+    chunk("IDAT", stream);
+    chunk("IEND", std::vector<unsigned char>());
+
+    FILE *file = std::fopen(filename.c_str(), "wb");
+    bool ok = file && std::fwrite(png.data(), 1, png.size(), file) == png.size();
+    if (file)
+        ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+    return ok;
+}
+
+#endif
@@ -8,14 +8,18 @@ class ray
 private:
     point3 orig;
     vec3 dir;
+    double tm;  // Moment in time the ray exists at, used for motion blur
 
 public:
     ray() {}
     // Any line in 3d plane can be represented by a point on the line and its direction
-    ray(const point3 &origin, const vec3 &direction) : orig(origin), dir(direction) {}
+    ray(const point3 &origin, const vec3 &direction) : orig(origin), dir(direction), tm(0) {}
+
+    ray(const point3 &origin, const vec3 &direction, double time) : orig(origin), dir(direction), tm(time) {}
 
     const point3 &origin() const { return orig; }
     const vec3 &direction() const { return dir; }
+    double time() const { return tm; }
 
     // Calculate a point along a ray
     // Point(T) = A * T + B
@@ -0,0 +1,87 @@
+#ifndef RAY_BATCH_H
+#define RAY_BATCH_H
+
+#include "commons.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// State of one camera sample in the batched renderer: the ray it continues with,
+// how much light is left after all the bounces so far, and the pixel it adds its light to.
+struct path_state
+{
+    ray r;
+    color throughput;
+    std::uint64_t pixel;    // Index of the pixel in the whole image
+    std::uint32_t sample;   // Index of the sample in its pixel
+    double scatter_pdf;     // Density of the direction of r, 0 for camera rays and mirror bounces (see camera.h)
+};
+
+// Spreads the lower 10 bits of x so there are two zero bits between every bit: abc -> a00b00c
+inline std::uint64_t spread_bits(std::uint64_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+/*
+    Ray sort key
+    After a diffuse bounce rays leave in random directions from random places, so tracing them in
+    the order they were created jumps all over the BVH. Sorting them by a key that puts similar rays
+    next to each other makes consecutive rays visit the same nodes while those are still in the cache.
+    From the most significant bits to the least:
+        - octant:    the signs of the 3 direction components (rays in the same octant visit
+                     the children of a node in the same order)
+        - origin:    Morton code of the origin quantized to a 1024^3 grid over "bounds"
+                     (interleaving the x, y, z bits keeps points that are close in space close in the order)
+        - direction: the direction quantized to 4 bits for each of |x| and |y|
+*/
+inline std::uint64_t ray_sort_key(const ray &r, const aabb &bounds)
+{
+    const vec3 &d = r.direction();
+    std::uint64_t octant = (d.x() < 0 ? 4 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 1 : 0);
+
+    std::uint64_t cell[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const interval &range = bounds.axis_interval(axis);
+        double f = range.size() > 0 ? (r.origin()[axis] - range.min) / range.size() : 0;
+        cell[axis] = static_cast<std::uint64_t>(interval(0, 1023).clamp(f * 1024));
+    }
+    std::uint64_t morton = (spread_bits(cell[0]) << 2) | (spread_bits(cell[1]) << 1) | spread_bits(cell[2]);
+
+    auto unit = unit_vector(d);
+    auto qx = static_cast<std::uint64_t>(interval(0, 15).clamp(std::fabs(unit.x()) * 16));
+    auto qy = static_cast<std::uint64_t>(interval(0, 15).clamp(std::fabs(unit.y()) * 16));
+
+    return (octant << 38) | (morton << 8) | (qx << 4) | qy;
+}
+
+// Reorders the paths by ray_sort_key. The grid of the origin key spans the box around all the
+// origins of this batch (and not the scene box, which can be infinite with a ground plane).
+inline void sort_paths(std::vector<path_state> &paths)
+{
+    aabb bounds = aabb::empty;
+    for (const auto &path : paths)
+        bounds = aabb(bounds, aabb(path.r.origin(), path.r.origin()));
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> keys(paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+        keys[i] = std::make_pair(ray_sort_key(paths[i].r, bounds), static_cast<std::uint32_t>(i));
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<path_state> sorted;
+    sorted.reserve(paths.size());
+    for (const auto &key : keys)
+        sorted.push_back(paths[key.second]);
+    paths.swap(sorted);
+}
+
+#endif
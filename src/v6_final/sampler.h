@@ -0,0 +1,603 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "commons.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+    Samplers
+    Every random decision of one camera sample is a "dimension": where in the pixel the ray goes (2),
+    where on the lens (2), at what time (1), then for every bounce the scattered direction, the light
+    to sample and the point on it... Independent random numbers leave gaps and clumps between the
+    samples of a pixel, and the noise only goes down as 1/√N. Spreading the N samples of a pixel evenly
+    over each dimension (and each pair of dimensions) makes the error go down much faster.
+
+    The dimensions always follow the same layout, so the same dimension is used for the same decision
+    of every sample, whatever happened on the previous bounces:
+        [0, 5)                          camera: pixel (2), lens (2), time (1)
+        then, for every bounce b:
+            [0, 3)                      the material scattering the ray
+            [3, 8)                      light sampling (see camera::sample_lights)
+    Code that needs a random number calls sample_1d() or sample_2d(), which use the sampler of the
+    current thread, or random_double() when there is none (only outside of a render).
+
+    Samplers are pure functions of (pixel, sample index, dimension): they don't keep any state,
+    the same sample can be asked for again, and pixels can be rendered in any order.
+*/
+enum class sampling_pattern { independent, stratified, halton, sobol, blue_noise };
+
+class sampler
+{
+public:
+    static const std::uint32_t camera_dimensions = 5;
+    static const std::uint32_t scatter_dimensions = 3;
+    static const std::uint32_t light_dimensions = 5;
+    static const std::uint32_t bounce_dimensions = scatter_dimensions + light_dimensions;
+
+    virtual ~sampler() = default;
+
+    // Starts sample "index" of pixel "pixel" (its index in the whole image), at the camera dimensions
+    void start(std::uint64_t pixel, std::uint32_t index)
+    {
+        current_pixel = pixel;
+        current_index = index;
+        dimension = 0;
+    }
+
+    // Jumps to the dimensions of the scattering, or of the light sampling, of a bounce
+    void start_scatter(int bounce) { dimension = camera_dimensions + bounce * bounce_dimensions; }
+    void start_light(int bounce) { dimension = camera_dimensions + bounce * bounce_dimensions + scatter_dimensions; }
+
+    double get_1d()
+    {
+        return value_1d(current_pixel, current_index, dimension++);
+    }
+
+    // Two dimensions that are well distributed together, as the x, y of a vec3 (z is 0)
+    vec3 get_2d()
+    {
+        auto v = value_2d(current_pixel, current_index, dimension);
+        dimension += 2;
+        return v;
+    }
+
+    // Sampler of the current thread, nullptr if there is none
+    static sampler *&current()
+    {
+        static thread_local sampler *active = nullptr;
+        return active;
+    }
+
+    // Installs a sampler for the current thread until the end of the scope
+    class scope
+    {
+    public:
+        scope(sampler &s) : previous(current()) { current() = &s; }
+        ~scope() { current() = previous; }
+
+    private:
+        sampler *previous;
+    };
+
+    static shared_ptr<sampler> create(sampling_pattern pattern, int samples_per_pixel, int image_width);
+
+protected:
+    virtual double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const = 0;
+
+    // Samplers without a good 2D pattern use two separate dimensions
+    virtual vec3 value_2d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const
+    {
+        return vec3(value_1d(pixel, index, dim), value_1d(pixel, index, dim + 1), 0);
+    }
+
+    // Integer hash with good avalanche: every input bit changes about half of the output bits
+    static std::uint32_t hash(std::uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static std::uint32_t hash(std::uint32_t a, std::uint32_t b)
+    {
+        return hash(a ^ (hash(b) + 0x9e3779b9 + (a << 6) + (a >> 2)));
+    }
+
+    static std::uint32_t hash(std::uint32_t a, std::uint32_t b, std::uint32_t c)
+    {
+        return hash(hash(a, b), c);
+    }
+
+    // The pixel as 32 bits for the hashes: pixels past 2³² (images over 4 gigapixels) fold their high bits
+    // in, instead of wrapping around onto the first pixels and repeating their samples.
+    // The pixels below are unchanged, hash(0) is 0.
+    static std::uint32_t pixel_key(std::uint64_t pixel)
+    {
+        return std::uint32_t(pixel) ^ hash(std::uint32_t(pixel >> 32));
+    }
+
+    // Maps 32 random bits to [0, 1)
+    static double to_unit(std::uint32_t bits)
+    {
+        return bits * (1.0 / 4294967296.0);
+    }
+
+    // Kensler's permutation: a random permutation of [0, l) chosen by p, computed for one element at a time.
+    // It permutes within the next power of 2 and repeats until the result is below l.
+    static std::uint32_t permute(std::uint32_t i, std::uint32_t l, std::uint32_t p)
+    {
+        if (l <= 1)
+            return 0;
+        std::uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do
+        {
+            i ^= p;
+            i *= 0xe170893d;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3f;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3df;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+        return (i + p) % l;
+    }
+
+private:
+    std::uint64_t current_pixel = 0;
+    std::uint32_t current_index = 0;
+    std::uint32_t dimension = 0;
+};
+
+/*
+    Plain random numbers, every dimension of every sample is independent
+    They are counter based: the number for (pixel, sample, dimension) is a hash of these three, instead of
+    the next output of a generator whose state depends on everything drawn before. A pixel gets the same
+    noise whatever order the pixels are rendered in, by however many threads, tiles or processes.
+*/
+class independent_sampler : public sampler
+{
+protected:
+    double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        // Two rounds of the splitmix64 finalizer, then the top 53 bits as the mantissa of a double.
+        // The high bits of pixels past 2³² are mixed in separately (mix(0) is 0).
+        auto x = mix(mix((pixel << 32 | index) ^ mix(pixel >> 32)) ^ (dim * 0x9e3779b97f4a7c15ull));
+        return (x >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+};
+
+/*
+    Stratified sampler (correlated multi-jittered sampling, Kensler 2013)
+    The N samples of a pixel each get their own stratum: in 1D the range [0, 1) is cut in N equal parts,
+    in 2D the square is cut in a grid of about √N x √N cells and also in N thin columns and N thin rows,
+    and every sample lands in a different cell, column and row. Each sample is jittered inside its stratum,
+    and the strata are shuffled differently for every pixel and dimension so the dimensions don't correlate.
+    Sample indices from N on start over with a different shuffle.
+*/
+class stratified_sampler : public sampler
+{
+public:
+    stratified_sampler(int samples_per_pixel) : count(samples_per_pixel > 0 ? samples_per_pixel : 1) {}
+
+protected:
+    double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        auto seed = hash(pixel_key(pixel), dim, index / count);
+        auto s = permute(index % count, count, seed);
+        return (s + to_unit(hash(index, seed))) / count;
+    }
+
+    vec3 value_2d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        auto seed = hash(pixel_key(pixel), dim, index / count);
+        auto m = static_cast<std::uint32_t>(std::sqrt(double(count)));
+        auto n = (count + m - 1) / m;
+
+        auto s = permute(index % count, count, seed * 0x51633e2d);
+        auto sx = permute(s % m, m, seed * 0x68bc21eb);
+        auto sy = permute(s / m, n, seed * 0x02e5be93);
+        auto jx = to_unit(hash(s, seed * 0x967a889b));
+        auto jy = to_unit(hash(s, seed * 0x368cc8b7));
+
+        return vec3((sx + (sy + jx) / n) / m, (s + jy) / count, 0);
+    }
+
+private:
+    std::uint32_t count;
+};
+
+/*
+    Halton sampler
+    Dimension d uses the radical inverse in the d-th prime base b: the digits of the sample index
+    written in base b are mirrored around the decimal point (index 6 = 110 in base 2 -> 0.011 = 0.375).
+    Every prefix of the sequence fills [0, 1) evenly, and different prime bases don't line up with
+    each other. But with a large base b the first b points are just 0, 1/b, 2/b... all bunched up
+    near 0, so the digits are Owen scrambled: every digit goes through a random permutation of
+    [0, b) chosen by the digits before it. The points are still evenly spread but in a random order,
+    and each pixel uses different permutations so pixels don't repeat the same pattern.
+    Dimensions past the first max_dimensions just use random numbers.
+*/
+class halton_sampler : public sampler
+{
+public:
+    static const std::uint32_t max_dimensions = 128;
+
+    halton_sampler() : primes(first_primes(max_dimensions)) {}
+
+protected:
+    double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        if (dim >= max_dimensions)
+            return to_unit(hash(pixel_key(pixel), dim, index));
+
+        return scrambled_radical_inverse(primes[dim], index, hash(pixel_key(pixel), dim));
+    }
+
+private:
+    std::vector<std::uint32_t> primes;
+
+    // Radical inverse with every digit permuted. The zeros after the last digit of the index are
+    // permuted too, so the digits continue down to about 30 bits of precision.
+    static double scrambled_radical_inverse(std::uint32_t base, std::uint32_t index, std::uint32_t seed)
+    {
+        double inv_base = 1.0 / base;
+        double factor = inv_base;
+        double result = 0;
+        while (factor > 1e-9)
+        {
+            auto digit = index % base;
+            index /= base;
+            result += permute(digit, base, seed) * factor;
+            seed = hash(seed, digit);
+            factor *= inv_base;
+        }
+        return std::fmin(result, 1 - 1e-16);
+    }
+
+    static std::vector<std::uint32_t> first_primes(std::uint32_t count)
+    {
+        std::vector<std::uint32_t> result;
+        for (std::uint32_t candidate = 2; result.size() < count; candidate++)
+        {
+            bool is_prime = true;
+            for (auto p : result)
+            {
+                if (p * p > candidate)
+                    break;
+                if (candidate % p == 0)
+                {
+                    is_prime = false;
+                    break;
+                }
+            }
+            if (is_prime)
+                result.push_back(candidate);
+        }
+        return result;
+    }
+};
+
+/*
+    Owen-scrambled Sobol sampler (Burley 2020, "Practical Hash-based Owen Scrambling")
+    The first two dimensions of the Sobol sequence are a (0, 2)-sequence: any power of 2 number of
+    consecutive points puts exactly one point in every cell of any grid of that many equal cells
+    (4x4, 2x8, 1x16, ...). Owen scrambling randomly flips halves, quarters, eighths... of the unit
+    interval in a nested way, which keeps that property while making the points random, so the
+    results are unbiased and the error stays far below random sampling.
+    Every pair of dimensions uses those same two Sobol dimensions ("padding"), with a different
+    scrambling and a shuffled order of the points, so pairs are decorrelated from each other and from
+    neighbouring pixels. Sample counts that are powers of 2 work best.
+*/
+class sobol_sampler : public sampler
+{
+public:
+    sobol_sampler()
+    {
+        // Direction numbers of the second dimension (primitive polynomial x + 1)
+        directions[0] = 1u << 31;
+        for (int k = 1; k < 32; k++)
+            directions[k] = directions[k - 1] ^ (directions[k - 1] >> 1);
+    }
+
+protected:
+    double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        auto seed = hash(pixel_key(pixel), dim);
+        auto i = nested_uniform_scramble(index, seed);
+        return to_unit(nested_uniform_scramble(reverse_bits(i), hash(seed, 0)));
+    }
+
+    vec3 value_2d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        auto seed = hash(pixel_key(pixel), dim);
+        auto i = nested_uniform_scramble(index, seed);
+        auto x = nested_uniform_scramble(reverse_bits(i), hash(seed, 0));
+        auto y = nested_uniform_scramble(sobol_second(i), hash(seed, 1));
+        return vec3(to_unit(x), to_unit(y), 0);
+    }
+
+private:
+    std::uint32_t directions[32];
+
+    // Second Sobol dimension: XOR of the direction numbers of the set bits of the index
+    std::uint32_t sobol_second(std::uint32_t index) const
+    {
+        std::uint32_t result = 0;
+        for (int k = 0; index != 0; index >>= 1, k++)
+        {
+            if (index & 1)
+                result ^= directions[k];
+        }
+        return result;
+    }
+
+    static std::uint32_t reverse_bits(std::uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+        x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+        x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+        x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Hash in which every bit only depends on the bits below it (Laine-Karras), on the reversed bits
+    // this flips each bit based on the bits above it only: exactly a nested uniform (Owen) scramble
+    static std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed)
+    {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47c;
+        x ^= x * 0xb82f1e52;
+        x ^= x * 0xc7afe638;
+        x ^= x * 0x8d22f6e6;
+        return reverse_bits(x);
+    }
+};
+
+/*
+    Blue noise sampler, for previews with very few samples per pixel
+    With 1 to 4 samples the error of every pixel is large whatever the sampler, what can still be chosen
+    is how the errors of neighbouring pixels relate. With random numbers they are independent (white
+    noise), which the eye sees as harsh grain. Blue noise values are as different as possible from their
+    neighbours, so the errors alternate from pixel to pixel and blur away into a much smoother image.
+        - A 64x64 blue noise texture is built once with the void-and-cluster method (Ulichney 1993):
+          every texel gets a rank, given so that texels of consecutive ranks are far apart. The texture
+          is tiled over the image, and every dimension uses it shifted by a different offset.
+        - The samples of a pixel follow a rank-1 lattice, i * (golden ratio) for 1D and the R2 sequence
+          for 2D, shifted (modulo 1) by the blue noise value of the pixel, so every sample of a pixel
+          keeps the blue noise pattern between pixels.
+*/
+class blue_noise_sampler : public sampler
+{
+public:
+    static const int texture_size = 64;
+
+    blue_noise_sampler(int image_width) : width(image_width > 0 ? image_width : 1), ranks(texture()) {}
+
+protected:
+    double value_1d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        auto value = noise(pixel, dim) + index * 0.6180339887498949;
+        return value - std::floor(value);
+    }
+
+    vec3 value_2d(std::uint64_t pixel, std::uint32_t index, std::uint32_t dim) const override
+    {
+        // R2: the 2D generalization of the golden ratio, 1/g and 1/g² with g³ = g + 1
+        auto x = noise(pixel, dim) + index * 0.7548776662466927;
+        auto y = noise(pixel, dim + 1) + index * 0.5698402909980532;
+        return vec3(x - std::floor(x), y - std::floor(y), 0);
+    }
+
+private:
+    std::uint32_t width;
+    const std::vector<std::uint16_t> &ranks;
+
+    // Value of the texture for a pixel and dimension, jittered inside the rank so values cover [0, 1)
+    double noise(std::uint64_t pixel, std::uint32_t dim) const
+    {
+        auto offset = hash(dim, 0x2e5be93);
+        auto x = (pixel % width + offset) % texture_size;
+        auto y = (pixel / width + (offset >> 16)) % texture_size;
+        auto rank = ranks[y * texture_size + x];
+        return (rank + to_unit(hash(pixel_key(pixel), dim))) / (texture_size * texture_size);
+    }
+
+    // The texture is the same for every image, it is built the first time it is needed
+    static const std::vector<std::uint16_t> &texture()
+    {
+        static const std::vector<std::uint16_t> ranks = void_and_cluster(texture_size);
+        return ranks;
+    }
+
+    /*
+        Void-and-cluster
+        The "energy" of a texel is the sum of a Gaussian of its distance (wrapping around the edges)
+        to every set texel: large in a tight cluster of set texels, small in a void between them.
+            1. Start from random set texels, and repeatedly move the set texel of the tightest cluster
+               to the largest void until that stops changing anything: an evenly spread pattern.
+            2. Remove the set texels one at a time, tightest cluster first, ranks counting down.
+            3. From the initial pattern, set the empty texels one at a time, largest void first,
+               ranks counting up, until every texel is set.
+    */
+    static std::vector<std::uint16_t> void_and_cluster(int size)
+    {
+        const int count = size * size;
+        const double sigma = 1.5;
+
+        // Gaussian of every wrapped offset
+        std::vector<double> kernel(count);
+        for (int dy = 0; dy < size; dy++)
+        {
+            for (int dx = 0; dx < size; dx++)
+            {
+                int wx = std::min(dx, size - dx);
+                int wy = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+            }
+        }
+
+        std::vector<unsigned char> set(count, 0);
+        std::vector<double> energy(count, 0.0);
+        auto toggle = [&](int p, bool on) {
+            set[p] = on;
+            int px = p % size, py = p / size;
+            double sign = on ? 1 : -1;
+            for (int y = 0; y < size; y++)
+            {
+                const double *row = &kernel[((y - py + size) % size) * size];
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * row[(x - px + size) % size];
+            }
+        };
+        auto tightest_cluster = [&]() {
+            int best = 0;
+            double best_energy = -infinity;
+            for (int p = 0; p < count; p++)
+            {
+                if (set[p] && energy[p] > best_energy)
+                {
+                    best = p;
+                    best_energy = energy[p];
+                }
+            }
+            return best;
+        };
+        auto largest_void = [&]() {
+            int best = 0;
+            double best_energy = infinity;
+            for (int p = 0; p < count; p++)
+            {
+                if (!set[p] && energy[p] < best_energy)
+                {
+                    best = p;
+                    best_energy = energy[p];
+                }
+            }
+            return best;
+        };
+
+        // 1. Initial pattern, a tenth of the texels
+        int initial = count / 10;
+        for (std::uint32_t i = 0; std::count(set.begin(), set.end(), 1) < initial; i++)
+        {
+            int p = hash(i, 0x9e3779b9) % count;
+            if (!set[p])
+                toggle(p, true);
+        }
+        while (true)
+        {
+            int cluster = tightest_cluster();
+            toggle(cluster, false);
+            int hole = largest_void();
+            toggle(hole, true);
+            if (hole == cluster)
+                break;
+        }
+        auto initial_set = set;
+        auto initial_energy = energy;
+
+        std::vector<std::uint16_t> ranks(count);
+
+        // 2. Ranks below the initial pattern
+        for (int rank = initial - 1; rank >= 0; rank--)
+        {
+            int p = tightest_cluster();
+            toggle(p, false);
+            ranks[p] = static_cast<std::uint16_t>(rank);
+        }
+
+        // 3. Ranks above it
+        set = initial_set;
+        energy = initial_energy;
+        for (int rank = initial; rank < count; rank++)
+        {
+            int p = largest_void();
+            toggle(p, true);
+            ranks[p] = static_cast<std::uint16_t>(rank);
+        }
+        return ranks;
+    }
+};
+
+inline shared_ptr<sampler> sampler::create(sampling_pattern pattern, int samples_per_pixel, int image_width)
+{
+    switch (pattern)
+    {
+        case sampling_pattern::stratified: return make_shared<stratified_sampler>(samples_per_pixel);
+        case sampling_pattern::halton:     return make_shared<halton_sampler>();
+        case sampling_pattern::sobol:      return make_shared<sobol_sampler>();
+        case sampling_pattern::blue_noise: return make_shared<blue_noise_sampler>(image_width);
+        default:                           return make_shared<independent_sampler>();
+    }
+}
+
+// Next dimension of the current sample, or a random number without a sampler
+inline double sample_1d()
+{
+    auto s = sampler::current();
+    return s ? s->get_1d() : random_double();
+}
+
+// Next two dimensions of the current sample as the x, y of a vec3
+inline vec3 sample_2d()
+{
+    auto s = sampler::current();
+    return s ? s->get_2d() : vec3(random_double(), random_double(), 0);
+}
+
+// Point on the unit sphere from two sample dimensions
+inline vec3 sample_unit_vector()
+{
+    auto u = sample_2d();
+    return square_to_unit_vector(u.x(), u.y());
+}
+
+// Point in the unit disk from two sample dimensions
+inline vec3 sample_in_unit_disk()
+{
+    auto u = sample_2d();
+    return square_to_disk(u.x(), u.y());
+}
+
+// Cosine-weighted direction around +z from two sample dimensions
+inline vec3 sample_cosine_direction()
+{
+    auto u = sample_2d();
+    return square_to_cosine_direction(u.x(), u.y());
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include "commons.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+/*
+    Sampling kernels test
+    The closed-form kernels of vec3.h replaced rejection loops (pick points in a cube or a square until one
+    falls inside the sphere or disk). They must give the same distributions, which this test checks by
+    drawing samples both ways and comparing:
+        - the means of x, y, z and their products, within 5 standard errors of the difference
+        - a histogram of 8 x 8 equal-probability bins (height or radius² against angle) with a two-sample
+          chi-square test
+        - every sample of the kernel being on the sphere, in the disk or in the upper hemisphere
+    The cosine-weighted direction is compared with the normal plus a random unit vector, which is what
+    lambertian scattered before.
+    The generator has a fixed seed so the test always gives the same result. Returns 0 if all checks pass.
+*/
+
+const int sample_count = 400000;
+const int bins = 8;
+
+// Bin of a sample: 8 bins of a value uniform in [0, 1] for the distribution, times 8 bins of the angle around z
+typedef std::function<int(const vec3 &)> bin_function;
+
+int angle_bin(const vec3 &p)
+{
+    auto phi = std::atan2(p.y(), p.x()) + pi;
+    return std::min(bins - 1, int(phi / (2 * pi) * bins));
+}
+
+int value_bin(double value)
+{
+    return std::min(bins - 1, std::max(0, int(value * bins)));
+}
+
+struct distribution
+{
+    std::vector<double> sum, sum_squared;   // For the means of the moments
+    std::vector<double> histogram;
+
+    distribution() : sum(9, 0.0), sum_squared(9, 0.0), histogram(bins * bins, 0.0) {}
+
+    void add(const vec3 &p, const bin_function &bin)
+    {
+        double moments[9] = {p.x(), p.y(), p.z(), p.x() * p.x(), p.y() * p.y(), p.z() * p.z(),
+                             p.x() * p.y(), p.x() * p.z(), p.y() * p.z()};
+        for (int m = 0; m < 9; m++)
+        {
+            sum[m] += moments[m];
+            sum_squared[m] += moments[m] * moments[m];
+        }
+        histogram[bin(p)]++;
+    }
+};
+
+// Compares the kernel with the rejection sampler, returns the number of failed checks
+int compare(const char *name, std::function<vec3()> kernel, std::function<vec3()> rejection,
+            std::function<bool(const vec3 &)> valid, const bin_function &bin)
+{
+    distribution a, b;
+    int invalid = 0;
+    for (int k = 0; k < sample_count; k++)
+    {
+        auto p = kernel();
+        if (!valid(p))
+            invalid++;
+        a.add(p, bin);
+        b.add(rejection(), bin);
+    }
+
+    int failures = 0;
+    if (invalid > 0)
+    {
+        std::printf("%s: %d samples out of the domain\n", name, invalid);
+        failures++;
+    }
+
+    static const char *moment_names[9] = {"x", "y", "z", "x²", "y²", "z²", "xy", "xz", "yz"};
+    double n = sample_count;
+    for (int m = 0; m < 9; m++)
+    {
+        double mean_a = a.sum[m] / n, mean_b = b.sum[m] / n;
+        double variance_a = a.sum_squared[m] / n - mean_a * mean_a;
+        double variance_b = b.sum_squared[m] / n - mean_b * mean_b;
+        double error = std::sqrt((variance_a + variance_b) / n);
+        if (std::fabs(mean_a - mean_b) > 5 * error + 1e-12)
+        {
+            std::printf("%s: mean of %s is %.5f, %.5f with rejection\n", name, moment_names[m], mean_a, mean_b);
+            failures++;
+        }
+    }
+
+    // Same number of samples on both sides: chi² = Σ (a - b)² / (a + b), with 63 degrees of freedom
+    // (mean 63, standard deviation 11.2), 130 is 6 standard deviations away
+    double chi_squared = 0;
+    for (int k = 0; k < bins * bins; k++)
+        if (a.histogram[k] + b.histogram[k] > 0)
+            chi_squared += (a.histogram[k] - b.histogram[k]) * (a.histogram[k] - b.histogram[k]) /
+                           (a.histogram[k] + b.histogram[k]);
+    if (chi_squared > 130)
+    {
+        std::printf("%s: histograms differ, chi² = %.1f\n", name, chi_squared);
+        failures++;
+    }
+
+    std::printf("%s: %s (chi² = %.1f)\n", name, failures ? "FAILED" : "ok", chi_squared);
+    return failures;
+}
+
+vec3 rejection_unit_vector()
+{
+    while (true)
+    {
+        auto p = vec3::random(-1, 1);
+        auto lensq = p.length_squared();
+        if (1e-160 < lensq && lensq <= 1.0)
+            return p / std::sqrt(lensq);
+    }
+}
+
+vec3 rejection_disk()
+{
+    while (true)
+    {
+        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        if (p.length_squared() < 1)
+            return p;
+    }
+}
+
+vec3 rejection_cosine_direction()
+{
+    while (true)
+    {
+        auto p = vec3(0, 0, 1) + rejection_unit_vector();
+        if (!p.near_zero())
+            return unit_vector(p);
+    }
+}
+
+int main()
+{
+    auto uniform = [] { return random_double(); };
+    const double tolerance = 1e-12;
+    int failures = 0;
+
+    // Uniform on the sphere: z is uniform in [-1, 1] (Archimedes)
+    failures += compare("square_to_unit_vector",
+        [&] { auto u1 = uniform(); return square_to_unit_vector(u1, uniform()); },
+        rejection_unit_vector,
+        [&](const vec3 &p) { return std::fabs(p.length() - 1) < tolerance; },
+        [](const vec3 &p) { return value_bin((p.z() + 1) / 2) * bins + angle_bin(p); });
+
+    // Uniform in the disk: r² is uniform in [0, 1]
+    failures += compare("square_to_disk",
+        [&] { auto u1 = uniform(); return square_to_disk(u1, uniform()); },
+        rejection_disk,
+        [&](const vec3 &p) { return p.length_squared() <= 1 + tolerance && p.z() == 0; },
+        [](const vec3 &p) { return value_bin(p.length_squared()) * bins + angle_bin(p); });
+
+    // Cosine-weighted around +z: z² = cos²(θ) is uniform in [0, 1]
+    failures += compare("square_to_cosine_direction",
+        [&] { auto u1 = uniform(); return square_to_cosine_direction(u1, uniform()); },
+        rejection_cosine_direction,
+        [&](const vec3 &p) { return std::fabs(p.length() - 1) < tolerance && p.z() >= 0; },
+        [](const vec3 &p) { return value_bin(p.z() * p.z()) * bins + angle_bin(p); });
+
+    return failures == 0 ? 0 : 1;
+}
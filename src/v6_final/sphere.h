@@ -2,13 +2,26 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "onb.h"
+#include "sampler.h"
 #include "vec3.h"
 
 class sphere : public hittable
 {
 public:
+    // Stationary sphere
     sphere(const point3 &center, double radius, shared_ptr<material> mat) 
-        : center(center), radius(std::fmax(0, radius)), mat(mat) {}
+        : center(center), motion(0, 0, 0), radius(std::fmax(0, radius)), mat(mat)
+    {
+        update_bounding_box();
+    }
+
+    // Moving sphere: the center moves linearly from center1 at time 0 to center2 at time 1
+    sphere(const point3 &center1, const point3 &center2, double radius, shared_ptr<material> mat)
+        : center(center1), motion(center2 - center1), radius(std::fmax(0, radius)), mat(mat)
+    {
+        update_bounding_box();
+    }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
@@ -58,7 +71,9 @@ public:
             Cancel the 2's:
             t = (h ± sqrt(h⋅h - a⋅c)) / a    --- (4)
         */
-        vec3 oc = center - r.origin();
+        // For a moving sphere, use the center at the time the ray was cast
+        point3 current_center = center_at(r.time());
+        vec3 oc = current_center - r.origin();
         auto a = r.direction().length_squared(); // Using (1)
         auto h = dot(r.direction(), oc);         // Using (2)
         auto c = oc.length_squared() - radius * radius; // Using (3)
@@ -83,7 +98,7 @@ public:
         // Sets where the actual 3D position of that intersection
         rec.p = r.at(rec.t);
         // Sets unit vector perpendicular to the spheres surface where intersection happened
-        vec3 outward_normal = (rec.p - center) / radius; 
+        vec3 outward_normal = (rec.p - current_center) / radius;
         rec.set_face_normal(r, outward_normal);
         // Sets the material of the sphere
         rec.mat = mat;
@@ -91,10 +106,162 @@ public:
         return true;
     }
 
+    // Same test as hit() without filling a hit record
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        vec3 oc = center_at(r.time()) - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+    }
+
+    // Same math as hit(), written as one loop over all the rays of the packet.
+    // Both roots are computed for every ray and the choice between them is made without branches,
+    // so the loop can be vectorized. The hit records are only filled afterwards, for the rays that hit.
+    void hit_packet(const ray_packet &packet, const unsigned char *active, double t_min,
+                    packet_hits &hits) const override
+    {
+        double roots[ray_packet::max_size];
+        unsigned char found[ray_packet::max_size];
+        int any = 0;
+
+        for (int i = 0; i < packet.size; i++)
+        {
+            double ocx = center.x() + packet.time[i] * motion.x() - packet.ox[i];
+            double ocy = center.y() + packet.time[i] * motion.y() - packet.oy[i];
+            double ocz = center.z() + packet.time[i] * motion.z() - packet.oz[i];
+
+            double a = packet.dx[i] * packet.dx[i] + packet.dy[i] * packet.dy[i] + packet.dz[i] * packet.dz[i];
+            double h = packet.dx[i] * ocx + packet.dy[i] * ocy + packet.dz[i] * ocz;
+            double c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+            double discriminant = h * h - a * c;
+
+            double sqrtd = std::sqrt(discriminant > 0 ? discriminant : 0);
+            double near_root = (h - sqrtd) / a;
+            double far_root = (h + sqrtd) / a;
+            bool near_ok = near_root > t_min && near_root < hits.t[i];
+            bool far_ok = far_root > t_min && far_root < hits.t[i];
+
+            roots[i] = near_ok ? near_root : far_root;
+            found[i] = active[i] & (discriminant >= 0) & (near_ok | far_ok);
+            any |= found[i];
+        }
+
+        if (!any)
+            return;
+
+        for (int i = 0; i < packet.size; i++)
+        {
+            if (!found[i])
+                continue;
+            ray r = packet.get_ray(i);
+            hit_record &rec = hits.rec[i];
+            rec.t = roots[i];
+            rec.p = r.at(rec.t);
+            vec3 outward_normal = (rec.p - center_at(r.time())) / radius;
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = mat;
+            hits.t[i] = rec.t;
+            hits.hit[i] = true;
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override
+    {
+        auto rvec = vec3(radius, radius, radius);
+        auto c = center_at(time);
+        return aabb(c - rvec, c + rvec);
+    }
+
+    // Moves the sphere, used to animate a scene between frames.
+    // The box of the sphere is updated right away, but any bvh_node containing the sphere
+    // must be refit (see bvh.h) before the next frame is rendered.
+    // For a moving sphere this sets the center at time 0, the motion within the frame is kept.
+    void set_center(const point3 &new_center)
+    {
+        center = new_center;
+        update_bounding_box();
+    }
+
+    const point3 &get_center() const { return center; }
+
+    /*
+        Sampling a sphere light
+        Seen from a point outside, the sphere covers a cone of directions with half angle θmax:
+            sin(θmax) = radius / distance  =>  cos(θmax) = √(1 - radius² / distance²)
+        Picking directions uniformly inside that cone never wastes a sample on a direction that misses,
+        the cone has a solid angle of 2π(1 - cos(θmax)) so the density is 1 / (2π(1 - cos(θmax))).
+        From a point inside, every direction hits the sphere: directions are uniform over the whole
+        sphere of directions, a density of 1 / 4π.
+        A moving sphere is sampled where it is at the time of the ray.
+    */
+    double pdf_value(const point3 &origin, const vec3 &direction, double time) const override
+    {
+        hit_record rec;
+        if (!this->hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+            return 0;
+
+        auto distance_squared = (center_at(time) - origin).length_squared();
+        if (distance_squared <= radius * radius)
+            return 1 / (4 * pi);
+        auto cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+        auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+        return 1 / solid_angle;
+    }
+
+    vec3 random(const point3 &origin, double time) const override
+    {
+        vec3 direction = center_at(time) - origin;
+        auto distance_squared = direction.length_squared();
+        if (distance_squared <= radius * radius)
+            return sample_unit_vector();
+        onb uvw(direction);
+        return uvw.transform(random_to_sphere(radius, distance_squared));
+    }
+
 private:
-    point3 center;
+    point3 center;  // Center at time 0
+    vec3 motion;    // How far the center moves from time 0 to time 1
     double radius;
     shared_ptr<material> mat;
+    aabb bbox;
+
+    point3 center_at(double time) const
+    {
+        return center + time * motion;
+    }
+
+    // Random direction inside the cone around +z covering a sphere of the given radius and squared distance:
+    // φ is uniform in [0, 2π), and cos(θ) is uniform in [cos(θmax), 1] so the solid angle is evenly covered
+    static vec3 random_to_sphere(double radius, double distance_squared)
+    {
+        auto r = sample_2d();
+        auto r1 = r.x();
+        auto r2 = r.y();
+        auto z = 1 + r2 * (std::sqrt(1 - radius * radius / distance_squared) - 1);
+
+        auto phi = 2 * pi * r1;
+        auto x = std::cos(phi) * std::sqrt(1 - z * z);
+        auto y = std::sin(phi) * std::sqrt(1 - z * z);
+
+        return vec3(x, y, z);
+    }
+
+    // The box has to contain the sphere during the whole motion, so it encloses the boxes at time 0 and 1
+    void update_bounding_box()
+    {
+        bbox = aabb(bounding_box_at(0), bounding_box_at(1));
+    }
 };
 
 #endif
@@ -0,0 +1,97 @@
+#ifndef TILE_STREAM_H
+#define TILE_STREAM_H
+
+#include "commons.h"
+#include "framebuffer.h"
+#include "image_io.h"
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+    Tile stream
+    The PPM can only be written once the whole image is done, since its pixels go in scanline order.
+    In tile mode (camera_config::tile_size) every tile is sent to the tile stream as soon as it is finished,
+    so another process reading a pipe can show or composite the image while it renders:
+        ./build/v6 | viewer                         (tile_stream = "-")
+    The stream is binary, all numbers are little endian:
+        header      "RTTILES1", then width, height and channels (3, RGB) as 32-bit unsigned integers
+        tile        "TILE", then x, y, width, height of the tile and its samples per pixel (32-bit unsigned),
+                    then width * height pixels of channels 32-bit floats, rows from the top
+        end         "DONE"
+    Pixels are the linear average of the samples (not clamped or gamma corrected, like hdr_output).
+    Tiles come in the order they finish, which changes with the number of threads.
+    read_image (image_io.h) reads a whole stream, even from a pipe: ./build/v6 | ./build/tonemap /dev/stdin
+*/
+class tile_stream_writer
+{
+public:
+    ~tile_stream_writer() { close(); }
+
+    // Opens the stream and writes its header, "-" is the standard output
+    bool open(const std::string &filename, int width, int height)
+    {
+        to_stdout = filename == "-";
+        file = to_stdout ? stdout : std::fopen(filename.c_str(), "wb");
+        if (!file)
+            return false;
+
+        std::vector<unsigned char> header(tile_stream_magic, tile_stream_magic + 8);
+        put_u32(header, std::uint32_t(width));
+        put_u32(header, std::uint32_t(height));
+        put_u32(header, channels);
+        return write(header);
+    }
+
+    bool is_open() const { return file != nullptr; }
+
+    // Sends the beauty pass of "tile", the framebuffer of a finished tile at x, y of the image.
+    // Can be called from several threads at once.
+    void write_tile(const framebuffer &tile, int x, int y, int samples)
+    {
+        std::vector<unsigned char> bytes = {'T', 'I', 'L', 'E'};
+        bytes.reserve(24 + tile.pixel_count() * channels * 4);
+        for (auto v : {x, y, tile.width(), tile.height(), samples})
+            put_u32(bytes, std::uint32_t(v));
+        for (size_t pixel = 0; pixel < tile.pixel_count(); pixel++)
+        {
+            auto c = tile.value(pass::beauty, pixel);
+            for (int k = 0; k < 3; k++)
+                put_float(bytes, float(c[k]));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        write(bytes);
+        std::fflush(file);  // The reader is waiting for it
+    }
+
+    // Writes the end marker and closes the stream
+    void close()
+    {
+        if (!file)
+            return;
+        static const unsigned char done[4] = {'D', 'O', 'N', 'E'};
+        std::fwrite(done, 1, 4, file);
+        if (to_stdout)
+            std::fflush(file);
+        else
+            std::fclose(file);
+        file = nullptr;
+    }
+
+    static const std::uint32_t channels = 3;
+
+private:
+    FILE *file = nullptr;
+    bool to_stdout = false;
+    std::mutex mutex;
+
+    bool write(const std::vector<unsigned char> &bytes)
+    {
+        return std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    }
+};
+
+#endif
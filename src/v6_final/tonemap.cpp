@@ -0,0 +1,112 @@
+#include "commons.h"
+#include "image_io.h"
+#include "parallel.h"
+#include "png.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+    Tonemapping tool
+    Turns a float image written by the renderer (camera_config::hdr_output) into a PPM like the one the
+    renderer writes itself, without rendering again:
+        ./build/tonemap v6.exr --exposure 1.5 --operator aces > v6.ppm
+    --exposure   brightness change in stops, every +1 doubles the light (default 0)
+    --png        write a PNG file instead of the PPM on the standard output:
+                     ./build/tonemap v6.exr --png v6.png
+    --operator   how light above 1 is brought into the [0, 1] range of the screen:
+                     clamp      cut off at 1, the same as the renderer (default)
+                     reinhard   L / (1 + L), compresses the highlights smoothly
+                     aces       the filmic curve of the ACES standard (Narkowicz' fit), more contrast
+*/
+
+enum class tone_operator { clamp, reinhard, aces };
+
+color tonemap(const color &c, tone_operator op)
+{
+    switch (op)
+    {
+        case tone_operator::reinhard:
+        {
+            // On the brightness, so the hue of bright colors is kept
+            auto luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+            return c / (1 + std::fmax(0.0, luminance));
+        }
+        case tone_operator::aces:
+        {
+            color result;
+            for (int k = 0; k < 3; k++)
+            {
+                auto x = std::fmax(0.0, c[k]);
+                result[k] = x * (2.51 * x + 0.03) / (x * (2.43 * x + 0.59) + 0.14);
+            }
+            return result;
+        }
+        default:
+            return c;
+    }
+}
+
+int usage()
+{
+    std::cerr << "Usage: tonemap <image.pfm|.exr|.hdr> [--exposure <stops>] [--operator clamp|reinhard|aces] [--png <image.png>] > image.ppm\n";
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    std::string filename = argv[1];
+    double exposure = 0;
+    auto op = tone_operator::clamp;
+    std::string png_output;
+    for (int a = 2; a < argc; a++)
+    {
+        if (std::strcmp(argv[a], "--exposure") == 0 && a + 1 < argc)
+            exposure = std::atof(argv[++a]);
+        else if (std::strcmp(argv[a], "--png") == 0 && a + 1 < argc)
+            png_output = argv[++a];
+        else if (std::strcmp(argv[a], "--operator") == 0 && a + 1 < argc)
+        {
+            std::string name = argv[++a];
+            if (name == "clamp")
+                op = tone_operator::clamp;
+            else if (name == "reinhard")
+                op = tone_operator::reinhard;
+            else if (name == "aces")
+                op = tone_operator::aces;
+            else
+                return usage();
+        }
+        else
+            return usage();
+    }
+
+    int width, height;
+    std::vector<color> image;
+    if (!read_image(filename, width, height, image))
+    {
+        std::cerr << "ERROR: Could not load image '" << filename << "'.\n";
+        return 1;
+    }
+
+    auto scale = std::pow(2.0, exposure);
+    parallel_for(0, height, [&](int j) {
+        for (int i = 0; i < width; i++)
+        {
+            auto &c = image[size_t(j) * width + i];
+            c = tonemap(scale * c, op);
+        }
+    });
+
+    if (!png_output.empty())
+        return write_png(png_output, width, height, color_bytes(image)) ? 0 : 1;
+
+    std::cout << "P3\n" << width << ' ' << height << "\n255\n";
+    write_colors(std::cout, image, width);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "commons.h"
+
+// Affine transform stored as a 3x4 matrix: a 3x3 linear part (rotation, scale, shear)
+// in the first three columns and a translation in the last column.
+//      | m00 m01 m02 m03 |   | x |
+//      | m10 m11 m12 m13 | * | y |
+//      | m20 m21 m22 m23 |   | z |
+//                            | 1 |
+// The bottom row of a full 4x4 affine matrix is always (0 0 0 1), so we don't store it.
+class transform
+{
+public:
+    double m[3][4];
+
+    // Identity transform
+    transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static transform translate(const vec3 &offset)
+    {
+        transform t;
+        t.m[0][3] = offset.x();
+        t.m[1][3] = offset.y();
+        t.m[2][3] = offset.z();
+        return t;
+    }
+
+    static transform scale(const vec3 &s)
+    {
+        transform t;
+        t.m[0][0] = s.x();
+        t.m[1][1] = s.y();
+        t.m[2][2] = s.z();
+        return t;
+    }
+
+    static transform scale(double s) { return scale(vec3(s, s, s)); }
+
+    // Rotation of "degrees" around an arbitrary axis (Rodrigues' rotation formula)
+    static transform rotate(const vec3 &axis, double degrees)
+    {
+        auto a = unit_vector(axis);
+        auto theta = degrees_to_radians(degrees);
+        auto c = std::cos(theta);
+        auto s = std::sin(theta);
+        auto k = 1 - c;
+
+        transform t;
+        t.m[0][0] = a.x() * a.x() * k + c;
+        t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+        t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+        t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+        t.m[1][1] = a.y() * a.y() * k + c;
+        t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+        t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+        t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+        t.m[2][2] = a.z() * a.z() * k + c;
+        return t;
+    }
+
+    // Transforms a point, the translation is applied
+    point3 apply_point(const point3 &p) const
+    {
+        return point3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                      m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                      m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+
+    // Transforms a direction, the translation is ignored
+    vec3 apply_vector(const vec3 &v) const
+    {
+        return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    // Multiplies a vector by the transpose of the linear part.
+    // Normals must be transformed by the inverse transpose of the matrix that transforms points,
+    // otherwise they stop being perpendicular to the surface under non-uniform scaling.
+    // So the object-to-world normal transform is "world_to_object.apply_transpose(n)".
+    vec3 apply_transpose(const vec3 &n) const
+    {
+        return vec3(m[0][0] * n[0] + m[1][0] * n[1] + m[2][0] * n[2],
+                    m[0][1] * n[0] + m[1][1] * n[1] + m[2][1] * n[2],
+                    m[0][2] * n[0] + m[1][2] * n[1] + m[2][2] * n[2]);
+    }
+
+    transform inverse() const
+    {
+        // Inverse of the linear part using the adjugate matrix: A⁻¹ = adj(A) / det(A)
+        double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                   - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                   + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        double inv_det = 1.0 / det;
+
+        transform t;
+        t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+        // The inverse translation is -A⁻¹ * translation
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+        return t;
+    }
+};
+
+// Composition: (a * b) applies b first and then a
+inline transform operator*(const transform &a, const transform &b)
+{
+    transform t;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            t.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        t.m[i][3] += a.m[i][3];
+    }
+    return t;
+}
+
+#endif
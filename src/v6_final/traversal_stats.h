@@ -0,0 +1,64 @@
+#ifndef TRAVERSAL_STATS_H
+#define TRAVERSAL_STATS_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+    Traversal statistics
+    Counts how many acceleration structure nodes are visited, and how many of those visits would miss
+    in a small simulated cache. The cache is direct-mapped: every 64 byte block of memory can only sit
+    in one slot (chosen by its address), and a visit misses when that slot holds a different block.
+    Changing the order rays are traced in doesn't change how many nodes each ray visits, but rays
+    that visit the same nodes one after the other find them still in the cache, so the miss count
+    shows how coherent the memory accesses are.
+
+    Stats are only gathered while a traversal_stats is installed for the current thread:
+        traversal_stats stats;
+        traversal_stats::scope collect(stats);
+*/
+class traversal_stats
+{
+public:
+    std::uint64_t rays = 0;
+    std::uint64_t node_visits = 0;
+    std::uint64_t cache_misses = 0;
+
+    traversal_stats() : cache_tags(cache_lines, 0) {}
+
+    void visit(const void *node)
+    {
+        node_visits++;
+        auto block = reinterpret_cast<std::uintptr_t>(node) >> 6;
+        auto &tag = cache_tags[block & (cache_lines - 1)];
+        if (tag != block)
+        {
+            tag = block;
+            cache_misses++;
+        }
+    }
+
+    // Statistics of the current thread, nullptr when not collecting
+    static traversal_stats *&current()
+    {
+        static thread_local traversal_stats *stats = nullptr;
+        return stats;
+    }
+
+    // Installs a traversal_stats for the current thread until the end of the scope
+    class scope
+    {
+    public:
+        scope(traversal_stats &stats) : previous(current()) { current() = &stats; }
+        ~scope() { current() = previous; }
+
+    private:
+        traversal_stats *previous;
+    };
+
+private:
+    static const std::uintptr_t cache_lines = 512; // 512 lines of 64 bytes: a 32KB cache, like an L1 data cache
+    std::vector<std::uintptr_t> cache_tags;
+};
+
+#endif
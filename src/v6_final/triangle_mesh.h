@@ -0,0 +1,334 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "traversal_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Geometry of an indexed triangle mesh.
+// Every vertex is stored once, and each triangle is just 3 indices into the vertex array,
+// so vertices shared by neighbouring triangles are not duplicated.
+// A mesh_data can be shared by several triangle_mesh objects (e.g. with different materials).
+struct mesh_data
+{
+    std::vector<point3> vertices;
+    std::vector<vec3> normals;          // Optional per-vertex normals, same size as vertices or empty
+    std::vector<std::uint32_t> indices; // 3 indices per triangle
+
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+/*
+    Triangle mesh
+    A single hittable for the whole mesh. Instead of putting one heap allocated hittable per
+    triangle into a bvh_node, the mesh builds its own compact BVH: the nodes are stored in one
+    flat array, and the leaves point to ranges of an array of triangle indices.
+    For a million triangle mesh this is a few tens of bytes per triangle instead of a
+    shared_ptr, a vtable and a bounding box for every single triangle.
+*/
+class triangle_mesh : public hittable
+{
+public:
+    triangle_mesh(shared_ptr<mesh_data> data, shared_ptr<material> mat) : data(data), mat(mat)
+    {
+        build();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        std::uint32_t hit_triangle;
+        double hit_u, hit_v;
+        if (!traverse(r, ray_t, false, hit_triangle, hit_u, hit_v))
+            return false;
+
+        // The hit record is filled only once, for the closest triangle
+        const std::uint32_t *tri = &data->indices[3 * hit_triangle];
+        const point3 &p0 = data->vertices[tri[0]];
+        const point3 &p1 = data->vertices[tri[1]];
+        const point3 &p2 = data->vertices[tri[2]];
+
+        rec.t = ray_t.max;
+        rec.p = r.at(rec.t);
+        vec3 geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+        rec.set_face_normal(r, geometric_normal);
+
+        // Smooth shading: interpolate the vertex normals with the barycentric coordinates,
+        // turned to the same side as the geometric normal we keep for front_face.
+        if (!data->normals.empty())
+        {
+            vec3 shading_normal = (1 - hit_u - hit_v) * data->normals[tri[0]]
+                                + hit_u * data->normals[tri[1]]
+                                + hit_v * data->normals[tri[2]];
+            // Vertices without a normal have a zero normal, keep the geometric one if nothing is left
+            if (!shading_normal.near_zero())
+            {
+                shading_normal = unit_vector(shading_normal);
+                rec.normal = dot(shading_normal, rec.normal) < 0 ? -shading_normal : shading_normal;
+            }
+        }
+        rec.mat = mat;
+
+        return true;
+    }
+
+    // Stops at the first triangle found, which is usually long before the closest one
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        std::uint32_t hit_triangle;
+        double hit_u, hit_v;
+        return traverse(r, ray_t, true, hit_triangle, hit_u, hit_v);
+    }
+
+    aabb bounding_box() const override { return nodes.empty() ? aabb::empty : nodes[0].box; }
+
+    size_t triangle_count() const { return data->triangle_count(); }
+
+private:
+    struct flat_node
+    {
+        aabb box;
+        std::uint32_t first; // Interior: index of the left child (right child is first + 1). Leaf: first triangle
+        std::uint32_t count; // Number of triangles in a leaf, 0 for interior nodes
+        int axis;            // Split axis of an interior node
+    };
+
+    static const std::uint32_t max_leaf_size = 4;
+
+    shared_ptr<mesh_data> data;
+    shared_ptr<material> mat;
+    std::vector<flat_node> nodes;
+    std::vector<std::uint32_t> triangle_order; // Triangle indices, reordered so every leaf is a contiguous range
+
+    // Walks the BVH looking for the closest triangle hit by the ray in ray_t, or with any_hit,
+    // for the first one found. On a hit, ray_t.max is the distance to the triangle.
+    bool traverse(const ray &r, interval &ray_t, bool any_hit,
+                  std::uint32_t &hit_triangle, double &hit_u, double &hit_v) const
+    {
+        if (nodes.empty())
+            return false;
+
+        vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+        watertight_ray shear(r);
+
+        // Iterative traversal with a small stack, the flat BVH has no child pointers to recurse on
+        std::uint32_t stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        bool hit_anything = false;
+        auto stats = traversal_stats::current();
+
+        while (stack_size > 0)
+        {
+            const flat_node &node = nodes[stack[--stack_size]];
+            if (stats)
+                stats->visit(&node);
+            if (!hit_box(node.box, r, inv_dir, ray_t))
+                continue;
+
+            if (node.count > 0)
+            {
+                for (std::uint32_t i = node.first; i < node.first + node.count; i++)
+                {
+                    double t, u, v;
+                    if (hit_triangle_kernel(triangle_order[i], r, shear, ray_t, t, u, v))
+                    {
+                        // Shrink the interval so only closer triangles are accepted from now on
+                        ray_t.max = t;
+                        hit_anything = true;
+                        hit_triangle = triangle_order[i];
+                        hit_u = u;
+                        hit_v = v;
+                        if (any_hit)
+                            return true;
+                    }
+                }
+            }
+            else
+            {
+                // Visit the nearer child first, it is more likely to shorten ray_t for the other one
+                std::uint32_t near_child = node.first;
+                std::uint32_t far_child = node.first + 1;
+                if (r.direction()[node.axis] < 0)
+                    std::swap(near_child, far_child);
+                stack[stack_size++] = far_child;
+                stack[stack_size++] = near_child;
+            }
+        }
+        return hit_anything;
+    }
+
+    /*
+        Watertight ray/triangle intersection (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection")
+        The vertices are moved into a space where the ray starts at the origin and goes along +z: translate by
+        the ray origin, swap the axes so z is the largest component of the direction, then shear x and y.
+        The test is then in 2D, on the side of each edge the origin falls:
+            U = edge function of (p1, p2), V = of (p2, p0), W = of (p0, p1)
+        all of the same sign means a hit, and (U, V, W) / (U + V + W) are its barycentric coordinates.
+        An edge function only depends on the two vertices of its edge, and a shared edge gives the same value
+        with the opposite sign in both triangles, so a ray can't slip between two neighbours through rounding
+        (Möller–Trumbore computes u and v from different vectors in each triangle, which can leave cracks).
+        The shear only depends on the ray, it is computed once per ray by watertight_ray.
+    */
+    struct watertight_ray
+    {
+        int kx, ky, kz;     // Axes, kz is the largest component of the direction
+        double sx, sy, sz;  // Shear
+
+        explicit watertight_ray(const ray &r)
+        {
+            const vec3 &d = r.direction();
+            kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                     : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            // Keep the winding of the triangles, so the sign of U, V, W doesn't flip with the direction
+            if (d[kz] < 0)
+                std::swap(kx, ky);
+            sx = d[kx] / d[kz];
+            sy = d[ky] / d[kz];
+            sz = 1.0 / d[kz];
+        }
+    };
+
+    bool hit_triangle_kernel(std::uint32_t triangle, const ray &r, const watertight_ray &w, const interval &ray_t,
+                             double &t, double &u, double &v) const
+    {
+        const std::uint32_t *tri = &data->indices[3 * triangle];
+        vec3 a = data->vertices[tri[0]] - r.origin();
+        vec3 b = data->vertices[tri[1]] - r.origin();
+        vec3 c = data->vertices[tri[2]] - r.origin();
+
+        double ax = a[w.kx] - w.sx * a[w.kz], ay = a[w.ky] - w.sy * a[w.kz];
+        double bx = b[w.kx] - w.sx * b[w.kz], by = b[w.ky] - w.sy * b[w.kz];
+        double cx = c[w.kx] - w.sx * c[w.kz], cy = c[w.ky] - w.sy * c[w.kz];
+
+        double eu = cx * by - cy * bx;
+        double ev = ax * cy - ay * cx;
+        double ew = bx * ay - by * ax;
+
+        // An edge function of exactly 0 (the ray on the edge) is recomputed with more precision,
+        // so its sign is decided the same way for both triangles of the edge
+        if (eu == 0.0 || ev == 0.0 || ew == 0.0)
+        {
+            eu = double((long double)cx * by - (long double)cy * bx);
+            ev = double((long double)ax * cy - (long double)ay * cx);
+            ew = double((long double)bx * ay - (long double)by * ax);
+        }
+
+        // The edges are inclusive: on an edge both triangles are hit, neither is missed
+        if ((eu < 0 || ev < 0 || ew < 0) && (eu > 0 || ev > 0 || ew > 0))
+            return false;
+        double det = eu + ev + ew;
+        if (det == 0.0)     // The ray is in the triangle's plane
+            return false;
+
+        double az = w.sz * a[w.kz], bz = w.sz * b[w.kz], cz = w.sz * c[w.kz];
+        t = (eu * az + ev * bz + ew * cz) / det;
+        if (!ray_t.surrounds(t))
+            return false;
+        u = ev / det;
+        v = ew / det;
+        return true;
+    }
+
+    // Slab test with a precomputed inverse direction, shared by all nodes visited by the ray.
+    // The far distance is pushed out by its worst rounding error (3 operations, Ize's robust slab test),
+    // or a ray through a vertex or an edge on the side of a box could miss it and the watertight kernel.
+    static bool hit_box(const aabb &box, const ray &r, const vec3 &inv_dir, interval ray_t)
+    {
+        const double rounding = 1 + 2 * 3 * std::numeric_limits<double>::epsilon();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &ax = box.axis_interval(axis);
+            auto t0 = (ax.min - r.origin()[axis]) * inv_dir[axis];
+            auto t1 = (ax.max - r.origin()[axis]) * inv_dir[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t1 *= rounding;
+            if (t0 > ray_t.min)
+                ray_t.min = t0;
+            if (t1 < ray_t.max)
+                ray_t.max = t1;
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    aabb triangle_box(std::uint32_t triangle) const
+    {
+        const std::uint32_t *tri = &data->indices[3 * triangle];
+        aabb box(data->vertices[tri[0]], data->vertices[tri[1]]);
+        const point3 &p2 = data->vertices[tri[2]];
+        return aabb(box, aabb(p2, p2));
+    }
+
+    void build()
+    {
+        auto count = static_cast<std::uint32_t>(data->triangle_count());
+        if (count == 0)
+            return;
+
+        triangle_order.resize(count);
+        std::vector<aabb> boxes(count);
+        std::vector<point3> centroids(count);
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            triangle_order[i] = i;
+            boxes[i] = triangle_box(i);
+            centroids[i] = boxes[i].centroid();
+        }
+
+        nodes.reserve(2 * (count / max_leaf_size + 1));
+        nodes.push_back(flat_node());
+        build_node(0, 0, count, boxes, centroids);
+    }
+
+    // Same idea as bvh_node, split at the median of the longest axis, but into a flat array.
+    // The split uses the box of the triangle centroids, which separates long thin triangles better
+    // than the box of the triangles themselves.
+    void build_node(std::uint32_t node_index, std::uint32_t start, std::uint32_t end,
+                    const std::vector<aabb> &boxes, const std::vector<point3> &centroids)
+    {
+        aabb box = aabb::empty;
+        aabb centroid_box = aabb::empty;
+        for (std::uint32_t i = start; i < end; i++)
+        {
+            box = aabb(box, boxes[triangle_order[i]]);
+            const point3 &c = centroids[triangle_order[i]];
+            centroid_box = aabb(centroid_box, aabb(c, c));
+        }
+        nodes[node_index].box = box;
+
+        if (end - start <= max_leaf_size)
+        {
+            nodes[node_index].first = start;
+            nodes[node_index].count = end - start;
+            return;
+        }
+
+        int axis = centroid_box.longest_axis();
+        std::uint32_t mid = start + (end - start) / 2;
+        std::nth_element(triangle_order.begin() + start, triangle_order.begin() + mid, triangle_order.begin() + end,
+                         [&](std::uint32_t a, std::uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+        // Children are always allocated next to each other
+        auto left_index = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(flat_node());
+        nodes.push_back(flat_node());
+        nodes[node_index].first = left_index;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = axis;
+
+        build_node(left_index, start, mid, boxes, centroids);
+        build_node(left_index + 1, mid, end, boxes, centroids);
+    }
+};
+
+#endif
@@ -112,6 +112,11 @@ inline vec3 operator/(const vec3 &v, double t)
     return (1 / t) * v;
 }
 
+inline vec3 operator/(const vec3 &u, const vec3 &v)
+{
+    return vec3(u.e[0] / v.e[0], u.e[1] / v.e[1], u.e[2] / v.e[2]);
+}
+
 // Represents a scalar quantity
 // The magnitude is equal to the projection of a vector along a direction of another vector
 inline double dot(const vec3 &u, const vec3 &v)
@@ -134,28 +139,59 @@ inline vec3 unit_vector(const vec3 &v)
     return v / v.length();
 }
 
-// TODO
+/*
+    Closed-form sampling kernels
+    Each one turns two uniform numbers (u1, u2) in [0, 1) into a point with the wanted distribution.
+    Unlike a rejection loop ("draw until the point falls inside"), they always use exactly two random
+    numbers and always run the same instructions, so loops calling them have no unpredictable branches
+    and can be vectorized, and the two numbers can come from a sampler (see sampler.h).
+*/
+
+// Uniform point on the unit sphere: z = cos(θ) uniform in [-1, 1] and φ uniform in [0, 2π).
+// Archimedes: the band of the sphere between two heights has the same area as on the enclosing cylinder,
+// so a uniform height gives a uniform point.
+inline vec3 square_to_unit_vector(double u1, double u2)
+{
+    auto z = 1 - 2 * u1;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Uniform point in the unit disk (z = 0) with the concentric mapping (Shirley-Chiu): the square [-1, 1]²
+// is mapped to the disk ring by ring, every square around the center becomes a circle.
+// Points that are evenly spread in the square stay evenly spread in the disk.
+inline vec3 square_to_disk(double u1, double u2)
+{
+    auto a = 2 * u1 - 1;
+    auto b = 2 * u2 - 1;
+    bool wide = std::fabs(a) > std::fabs(b);
+    auto r = wide ? a : b;
+    auto other = wide ? b : a;
+    auto ratio = other / (r != 0 ? r : 1); // r is only 0 at the center, where the angle doesn't matter
+    auto phi = wide ? (pi / 4) * ratio : (pi / 2) - (pi / 4) * ratio;
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+// Cosine-weighted direction around +z, pdf = cos(θ) / π (Malley's method):
+// a uniform point of the disk lifted straight up onto the hemisphere
+inline vec3 square_to_cosine_direction(double u1, double u2)
+{
+    auto p = square_to_disk(u1, u2);
+    auto z = std::sqrt(std::fmax(0.0, 1 - p.x() * p.x() - p.y() * p.y()));
+    return vec3(p.x(), p.y(), z);
+}
+
+// Random point in the unit disk (z = 0)
 inline vec3 random_in_unit_disk()
 {
-    while (true)
-    {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
+    return square_to_disk(random_double(), random_double());
 }
 
 // Generates a random unit vector
 inline vec3 random_unit_vector()
 {
-    while (true)
-    {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        // Squaring very small values can underflow to zero, making normalization invalid (∞,∞,∞).
-        if (1e-160 < lensq && lensq <= 1.0)
-            return p / sqrt(lensq);
-    }
+    return square_to_unit_vector(random_double(), random_double());
 }
 
 // Generates a random vector on the hemisphere
@@ -0,0 +1,326 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "commons.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+    Worker processes
+    A render can be split between several processes instead of threads (camera_config::workers). The
+    coordinator forks the workers, so they start with a copy of the scene and the camera, and hands
+    them work items over pipes:
+        coordinator -> worker   the index of the item, then x, y, width, height (32-bit),
+                                or just an index of 0xffffffff to stop
+        worker -> coordinator   the index of the item (32-bit), the number of floats (64-bit) and the
+                                floats of the result (the planes of its framebuffer)
+    Items only depend on what is in the message, so the workers could as well run on other machines
+    and talk over sockets.
+    A worker that dies (crash, kill, closed pipe) loses its item, which is given to another worker, and
+    a new worker is started in its place. So does a worker that hangs: every item has a deadline of
+    10 times the slowest item so far (at least a minute), and an item that timed out counts as slow,
+    so it gets a longer deadline on its next try. A result of the wrong size is a lost item too. The random numbers of every sample only depend on its pixel,
+    sample and dimension (see sampler.h), so the result is the same whichever worker renders an item,
+    how often it is re-issued, and in what order the results come back.
+    POSIX only (fork, pipe, poll).
+*/
+struct work_item
+{
+    int x, y, width, height;
+};
+
+class worker_pool
+{
+public:
+    // Calls render(item) for every item in worker processes, which returns the result as floats, and
+    // merge(item, result) in this process with each result as it comes back. The result of an item
+    // must be floats_per_pixel floats for every pixel of the item.
+    // Returns false if the items couldn't all be rendered (workers dying over and over).
+    template <typename Render, typename Merge>
+    static bool run(int count, const std::vector<work_item> &items, size_t floats_per_pixel, Render render, Merge merge)
+    {
+        // Writing to the pipe of a dead worker must fail with EPIPE, not kill the coordinator
+        auto previous_handler = std::signal(SIGPIPE, SIG_IGN);
+
+        std::vector<worker> workers;
+        std::deque<int> pending;
+        for (int i = 0; i < int(items.size()); i++)
+            pending.push_back(i);
+        size_t done = 0;
+        int restarts_left = 4 * count;  // Workers that keep dying mean a bug, not bad luck
+        auto slowest = std::chrono::steady_clock::duration::zero();
+        auto deadline = [&](const worker &w) {
+            return w.started + std::max<std::chrono::steady_clock::duration>(std::chrono::minutes(1), 10 * slowest);
+        };
+
+        // Gives the next pending item to worker w, if there is one
+        auto give = [&](worker &w) {
+            while (w.alive() && w.item < 0 && !pending.empty())
+            {
+                w.item = pending.front();
+                w.started = std::chrono::steady_clock::now();
+                pending.pop_front();
+                const work_item &item = items[w.item];
+                std::uint32_t message[5] = {std::uint32_t(w.item), std::uint32_t(item.x), std::uint32_t(item.y),
+                                            std::uint32_t(item.width), std::uint32_t(item.height)};
+                if (!write_all(w.to_worker, message, sizeof(message)))
+                    lose(w, pending);
+            }
+        };
+
+        for (int i = 0; i < count; i++)
+            workers.push_back(start(workers, render));
+
+        bool ok = true;
+        while (done < items.size())
+        {
+            // Replace dead workers and keep everyone busy
+            for (auto &w : workers)
+            {
+                if (!w.alive() && !pending.empty() && restarts_left > 0)
+                {
+                    restarts_left--;
+                    w = start(workers, render);
+                }
+                give(w);
+            }
+
+            std::vector<pollfd> fds;
+            std::vector<worker *> busy;
+            auto now = std::chrono::steady_clock::now();
+            auto first_deadline = std::chrono::steady_clock::time_point::max();
+            for (auto &w : workers)
+                if (w.alive() && w.item >= 0)
+                {
+                    fds.push_back({w.from_worker, POLLIN, 0});
+                    busy.push_back(&w);
+                    first_deadline = std::min(first_deadline, deadline(w));
+                }
+            if (fds.empty())
+            {
+                std::cerr << "ERROR: All the worker processes died.\n";
+                ok = false;
+                break;
+            }
+
+            if (poll(fds.data(), fds.size(), milliseconds_until(first_deadline, now)) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ok = false;
+                break;
+            }
+
+            for (size_t k = 0; k < fds.size(); k++)
+            {
+                worker &w = *busy[k];
+                if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                {
+                    // Hung: no answer by the deadline
+                    if (std::chrono::steady_clock::now() >= deadline(w))
+                    {
+                        std::cerr << "ERROR: Worker " << w.pid << " timed out, restarting it.\n";
+                        slowest = std::max(slowest, std::chrono::steady_clock::now() - w.started);
+                        lose(w, pending);
+                    }
+                    continue;
+                }
+
+                // The worker writes the whole result at once, a short read means it died. The rest of
+                // the result must arrive by the deadline too, a worker can hang halfway through writing.
+                const work_item &item = items[w.item];
+                auto expected = size_t(item.width) * item.height * floats_per_pixel;
+                auto until = deadline(w);
+                std::uint32_t index;
+                std::uint64_t size;
+                std::vector<float> result;
+                bool received = read_all(w.from_worker, &index, sizeof(index), until) && int(index) == w.item &&
+                                read_all(w.from_worker, &size, sizeof(size), until) && size == expected;
+                if (received)
+                {
+                    result.resize(size);
+                    received = read_all(w.from_worker, result.data(), size * sizeof(float), until);
+                }
+                if (!received)
+                {
+                    lose(w, pending);
+                    continue;
+                }
+
+                slowest = std::max(slowest, std::chrono::steady_clock::now() - w.started);
+                w.item = -1;
+                merge(items[index], result);
+                done++;
+            }
+        }
+
+        for (auto &w : workers)
+            stop(w);
+        std::signal(SIGPIPE, previous_handler);
+        return ok;
+    }
+
+private:
+    struct worker
+    {
+        pid_t pid = -1;
+        int to_worker = -1;
+        int from_worker = -1;
+        int item = -1;      // Index of the item being rendered, -1 if idle
+        std::chrono::steady_clock::time_point started;  // When it was given the item
+
+        bool alive() const { return pid > 0; }
+    };
+
+    template <typename Render>
+    static worker start(const std::vector<worker> &others, Render &render)
+    {
+        worker w;
+        int commands[2], results[2];
+        if (pipe(commands) != 0)
+            return w;
+        if (pipe(results) != 0)
+        {
+            close(commands[0]);
+            close(commands[1]);
+            return w;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // Worker: the pipes of the other workers were inherited too, they must be closed or those
+            // workers wouldn't see the end of their pipe when the coordinator closes it
+            for (const auto &other : others)
+            {
+                if (other.to_worker >= 0)
+                    close(other.to_worker);
+                if (other.from_worker >= 0)
+                    close(other.from_worker);
+            }
+            close(commands[1]);
+            close(results[0]);
+            serve(commands[0], results[1], render);
+            _exit(0);   // Not exit(): the buffers of std::cout belong to the coordinator
+        }
+
+        close(commands[0]);
+        close(results[1]);
+        if (pid < 0)
+        {
+            close(commands[1]);
+            close(results[0]);
+            return w;
+        }
+        w.pid = pid;
+        w.to_worker = commands[1];
+        w.from_worker = results[0];
+        return w;
+    }
+
+    template <typename Render>
+    static void serve(int commands, int results, Render &render)
+    {
+        for (;;)
+        {
+            std::uint32_t message[5];
+            if (!read_all(commands, message, sizeof(std::uint32_t)) || message[0] == 0xffffffff ||
+                !read_all(commands, message + 1, 4 * sizeof(std::uint32_t)))
+                return;
+
+            std::uint32_t index = message[0];
+            work_item item = {int(message[1]), int(message[2]), int(message[3]), int(message[4])};
+            std::vector<float> result = render(item);
+
+            std::uint64_t size = result.size();
+            if (!write_all(results, &index, sizeof(index)) || !write_all(results, &size, sizeof(size)) ||
+                !write_all(results, result.data(), size * sizeof(float)))
+                return;
+        }
+    }
+
+    // The item of a worker which died goes back to the front of the queue
+    static void lose(worker &w, std::deque<int> &pending)
+    {
+        if (w.item >= 0)
+            pending.push_front(w.item);
+        w.item = -1;
+        kill(w.pid, SIGKILL);
+        stop(w);
+    }
+
+    static void stop(worker &w)
+    {
+        if (!w.alive())
+            return;
+        std::uint32_t quit = 0xffffffff;
+        write_all(w.to_worker, &quit, sizeof(quit));
+        close(w.to_worker);
+        close(w.from_worker);
+        waitpid(w.pid, nullptr, 0);
+        w = worker();
+    }
+
+    static bool write_all(int fd, const void *data, size_t size)
+    {
+        auto p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            auto n = write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    // Time left until a deadline for poll(), -1 (no limit) for time_point::max()
+    static int milliseconds_until(std::chrono::steady_clock::time_point deadline, std::chrono::steady_clock::time_point now)
+    {
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            return -1;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+        return int(std::min<long long>(std::max<long long>(left + 1, 0), 1 << 30));
+    }
+
+    // Reads exactly "size" bytes, giving up at the deadline (the worker side waits for commands forever)
+    static bool read_all(int fd, void *data, size_t size,
+                         std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+    {
+        auto p = static_cast<char *>(data);
+        while (size > 0)
+        {
+            pollfd ready = {fd, POLLIN, 0};
+            auto waiting = poll(&ready, 1, milliseconds_until(deadline, std::chrono::steady_clock::now()));
+            if (waiting < 0 && errno == EINTR)
+                continue;
+            if (waiting <= 0)
+                return false;
+            auto n = read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+};
+
+#endif